@@ -2,12 +2,14 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
 struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct timer;
 
 // bio.c
 void            binit(void);
@@ -24,6 +26,7 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             execp(struct proc*, char*, char**);
 
 // file.c
 struct file*    filealloc(void);
@@ -33,6 +36,7 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filesplice(struct file*, struct file*, int);
 
 // fs.c
 void            fsinit(int);
@@ -59,13 +63,29 @@ void            ramdiskinit(void);
 void            ramdiskintr(void);
 void            ramdiskrw(struct buf*);
 
+// hrtimer.c
+void            hrtimerinit(void);
+void            hrtimer_add(struct timer*, uint64);
+int             hrtimer_del(struct timer*);
+int             hrtimerintr(void);
+void            hrtimer_idle(int);
+void            ipi(int);
+
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
+void*           kalloc_zeroed(void);
+int             kzero_idle(void);
+void*           kalloc_pages(int);
+void            kfree_pages(void *, int);
 void            kinit(void);
-int             cow_map(pte_t* pte_parent, pagetable_t child_pagetable, uint64 va);
+void            kallocdump(void);
+void            cow_map(pte_t* pte_parent, pte_t* pte_child);
 int             cow_pgfault(pagetable_t pgtbl, uint64 va);
-unsigned char*  cow_refcount(uint64 pa);
+int             lazy_fault(pagetable_t pgtbl, uint64 va, int write);
+int             cow_refcount(uint64 pa);
+void            cow_refinc(uint64 pa);
+int             cow_refdec(uint64 pa);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -74,10 +94,14 @@ void            begin_op(void);
 void            end_op(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
 int             pipewrite(struct pipe*, uint64, int);
+int             pipetake(struct pipe*, int, char**, uint*);
+int             pipepush(struct pipe*, char*, uint, uint);
+int             pipevmsplice(struct pipe*, uint64, int);
 
 // printf.c
 void            printf(char*, ...);
@@ -89,6 +113,7 @@ void            backtrace(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
+int             spawn(char*, char**, struct file**);
 int             growproc(int);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
@@ -104,6 +129,9 @@ void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
+void            wakeupone(void*);
+int             sleeptimeout(void*, struct spinlock*, int);
+int             sleepuntil(uint64);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
@@ -112,6 +140,13 @@ void            procdump(void);
 // swtch.S
 void            swtch(struct context*, struct context*);
 
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+void            slabdump(void);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
@@ -135,6 +170,9 @@ int             strlen(const char*);
 int             strncmp(const char*, const char*, uint);
 char*           strncpy(char*, const char*, int);
 
+// stringbench.c
+void            stringbench(void);
+
 // syscall.c
 int             argint(int, int*);
 int             argstr(int, char*, int);
@@ -143,8 +181,22 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// usercopy.S
+int             copyuser(void*, void*, uint64);
+int             copyuserstr(char*, char*, uint64);
+
+// timer.c
+void            timerwheelinit(void);
+void            timer_init(struct timer*, void (*)(void*), void*);
+void            timer_add(struct timer*, uint64);
+int             timer_del(struct timer*);
+void            timertick(void);
+int             timer_npending(void);
+
 // trap.c
 extern uint     ticks;
+void            clockintr(uint64);
+uint64          clocknext(void);
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
@@ -160,6 +212,11 @@ int             uartgetc(void);
 // vm.c
 void            kvminit(void);
 void            kvminithart(void);
+uint64          asid_activate(struct proc*);
+void            kvmactivate(struct proc*);
+pagetable_t     kvmcreate(pagetable_t);
+void            kvmsetuser(struct proc*);
+void            cowdump(void);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
@@ -170,6 +227,7 @@ int             uvmcopy(pagetable_t, pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
+uint64          uvmgift(pagetable_t, uint64);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
@@ -11,6 +11,16 @@ static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uin
 
 int
 exec(char *path, char **argv)
+{
+  return execp(myproc(), path, argv);
+}
+
+// Replace p's user image with the program at path, run with
+// argv. p is the caller, or a new process that spawn() has not
+// made runnable yet. path is looked up in the caller's current
+// directory. Returns argc, or -1 leaving p as it was.
+int
+execp(struct proc *p, char *path, char **argv)
 {
   char *s, *last;
   int i, off;
@@ -19,7 +29,6 @@ exec(char *path, char **argv)
   struct inode *ip;
   struct proghdr ph;
   pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
 
   begin_op();
 
@@ -46,14 +55,19 @@ exec(char *path, char **argv)
       continue;
     if(ph.memsz < ph.filesz)
       goto bad;
-    if(ph.vaddr + ph.memsz < ph.vaddr)
+    if(ph.vaddr + ph.memsz < ph.vaddr || ph.vaddr + ph.memsz > USERTOP)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
-      goto bad;
-    sz = sz1;
     if((ph.vaddr % PGSIZE) != 0)
       goto bad;
+    // allocate only the pages backed by the file; whole pages of
+    // bss are filled in on first touch, reads from the zero page.
+    uint64 sz1;
+    if(ph.vaddr + ph.filesz > sz){
+      if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.filesz)) == 0)
+        goto bad;
+    }
+    if(ph.vaddr + ph.memsz > sz)
+      sz = ph.vaddr + ph.memsz;
     if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
       goto bad;
   }
@@ -61,13 +75,14 @@ exec(char *path, char **argv)
   end_op();
   ip = 0;
 
-  p = myproc();
   uint64 oldsz = p->sz;
 
   // Allocate two pages at the next page boundary.
   // Use the second as the user stack.
   sz = PGROUNDUP(sz);
   uint64 sz1;
+  if(sz + 2*PGSIZE > USERTOP)
+    goto bad;
   if((sz1 = uvmalloc(pagetable, sz, sz + 2*PGSIZE)) == 0)
     goto bad;
   sz = sz1;
@@ -111,9 +126,11 @@ exec(char *path, char **argv)
   // Commit to the user image.
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
+  p->asid = 0;  // the old ASID's TLB entries map the old image
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
+  kvmsetuser(p);
   proc_freepagetable(oldpagetable, oldsz);
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
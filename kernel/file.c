@@ -14,15 +14,19 @@
 #include "proc.h"
 
 struct devsw devsw[NDEV];
+
+// File structures come from a slab cache; the lock
+// protects every file's ref count.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kmem_cache *cache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  ftable.cache = kmem_cache_create("file", sizeof(struct file));
 }
 
 // Allocate a file structure.
@@ -31,16 +35,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kmem_cache_alloc(ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -72,6 +71,7 @@ fileclose(struct file *f)
   f->ref = 0;
   f->type = FD_NONE;
   release(&ftable.lock);
+  kmem_cache_free(ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -129,12 +129,49 @@ fileread(struct file *f, uint64 addr, int n)
   return r;
 }
 
+// Write n bytes at addr to inode-backed file f; addr is a
+// user virtual address if user_src is 1, else a kernel one.
+// Returns n, or -1.
+static int
+inodewrite(struct file *f, int user_src, uint64 addr, int n)
+{
+  int r, i;
+
+  // write a few blocks at a time to avoid exceeding
+  // the maximum log transaction size, including
+  // i-node, indirect block, allocation blocks,
+  // and 2 blocks of slop for non-aligned writes.
+  // this really belongs lower down, since writei()
+  // might be writing a device like the console.
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  i = 0;
+  while(i < n){
+    int n1 = n - i;
+    if(n1 > max)
+      n1 = max;
+
+    begin_op();
+    ilock(f->ip);
+    if ((r = writei(f->ip, user_src, addr + i, f->off, n1)) > 0)
+      f->off += r;
+    iunlock(f->ip);
+    end_op();
+
+    if(r != n1){
+      // error from writei
+      break;
+    }
+    i += r;
+  }
+  return i == n ? n : -1;
+}
+
 // Write to file f.
 // addr is a user virtual address.
 int
 filewrite(struct file *f, uint64 addr, int n)
 {
-  int r, ret = 0;
+  int ret = 0;
 
   if(f->writable == 0)
     return -1;
@@ -146,33 +183,7 @@ filewrite(struct file *f, uint64 addr, int n)
       return -1;
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
-    // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
-    int i = 0;
-    while(i < n){
-      int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
-
-      begin_op();
-      ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
-        f->off += r;
-      iunlock(f->ip);
-      end_op();
-
-      if(r != n1){
-        // error from writei
-        break;
-      }
-      i += r;
-    }
-    ret = (i == n ? n : -1);
+    ret = inodewrite(f, 1, addr, n);
   } else {
     panic("filewrite");
   }
@@ -180,3 +191,85 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+// Drop a reference to a page that splice is moving.
+static void
+putpage(char *page)
+{
+  if(cow_refdec((uint64)page) == 0)
+    kfree(page);
+}
+
+// Write the n bytes at page+off to f, for filesplice(), handing
+// over or dropping the caller's reference to page.
+// Returns the number of bytes written, or -1.
+static int
+splicewrite(struct file *f, char *page, uint off, int n)
+{
+  int r = -1;
+
+  if(f->type == FD_PIPE)
+    return pipepush(f->pipe, page, off, n) == 0 ? n : -1;
+  if(f->type == FD_DEVICE){
+    if(f->major >= 0 && f->major < NDEV && devsw[f->major].write)
+      r = devsw[f->major].write(0, (uint64)(page + off), n);
+  } else if(f->type == FD_INODE){
+    r = inodewrite(f, 0, (uint64)(page + off), n);
+  }
+  putpage(page);
+  return r;
+}
+
+// Move up to n bytes from in to out, one of which must be a
+// pipe, without a round trip through user memory. File data is
+// read into a page that goes into the pipe by reference; data
+// taken from a pipe is written out from the page it lies in.
+// Like read(), waits only if a pipe to read from is empty.
+// Returns the number of bytes moved, 0 at end of file, or -1.
+int
+filesplice(struct file *in, struct file *out, int n)
+{
+  char *page;
+  uint off;
+  int m, r, total;
+
+  if(in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+  if(in->type != FD_PIPE && out->type != FD_PIPE)
+    return -1;
+  if(in->type != FD_PIPE && in->type != FD_INODE)
+    return -1;
+
+  for(total = 0; total < n; total += m){
+    if(in->type == FD_PIPE){
+      if(total > 0)
+        break;  // do not wait for more
+      if((m = pipetake(in->pipe, n, &page, &off)) <= 0)
+        return m;
+    } else {
+      if((page = kalloc()) == 0)
+        break;
+      cow_refinc((uint64)page);
+      off = 0;
+      m = n - total;
+      if(m > PGSIZE)
+        m = PGSIZE;
+      ilock(in->ip);
+      if((m = readi(in->ip, 0, (uint64)page, in->off, m)) > 0)
+        in->off += m;
+      iunlock(in->ip);
+      if(m <= 0){
+        putpage(page);
+        if(m < 0 && total == 0)
+          return -1;
+        break;
+      }
+    }
+    if((r = splicewrite(out, page, off, m)) != m){
+      if(r > 0)
+        total += r;
+      return total > 0 ? total : -1;
+    }
+  }
+  return total;
+}
+
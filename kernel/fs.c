@@ -127,12 +127,15 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a table entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in table: in-memory inodes come from a slab
+//   cache and are found through a hash of (dev, inum).
+//   ip->ref tracks the number of in-memory pointers to the
+//   entry (open files and current directories). iget() finds
+//   or creates a table entry and increments its ref; iput()
+//   decrements ref. An entry whose ref has fallen to zero
+//   stays in the table, on an LRU list, until more than
+//   NINODE entries are unreferenced; then the least recently
+//   used one is freed.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
@@ -163,28 +166,62 @@ bfree(int dev, uint b)
 // multi-step atomic operations.
 //
 // The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// entries, the hash chains and the LRU list. Since ip->ref
+// indicates whether an entry is in use, and ip->dev and ip->inum
+// indicate which i-node an entry holds, one must hold itable.lock
+// while using any of those fields.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 61
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIHASH)
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct kmem_cache *cache;
+  struct inode *hash[NIHASH];
+
+  // Linked list of unreferenced inodes, through prev/next.
+  // Sorted by how recently the inode was released.
+  // head.next is most recent, head.prev is least.
+  struct inode head;
+  int nunused;
 } itable;
 
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+  itable.cache = kmem_cache_create("inode", sizeof(struct inode));
+  itable.head.prev = &itable.head;
+  itable.head.next = &itable.head;
+}
+
+// Remove ip from its hash chain. Caller holds itable.lock.
+static void
+iunhash(struct inode *ip)
+{
+  struct inode **pp;
+
+  for(pp = &itable.hash[IHASH(ip->dev, ip->inum)]; *pp; pp = &(*pp)->hnext){
+    if(*pp == ip){
+      *pp = ip->hnext;
+      return;
+    }
   }
+  panic("iunhash");
+}
+
+// Take an unreferenced ip off the LRU list.
+// Caller holds itable.lock.
+static void
+iunlru(struct inode *ip)
+{
+  ip->next->prev = ip->prev;
+  ip->prev->next = ip->next;
+  itable.nunused--;
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -242,31 +279,39 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
+  uint h = IHASH(dev, inum);
 
   acquire(&itable.lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  for(ip = itable.hash[h]; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        iunlru(ip);
       release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
+  // Allocate a new entry, or recycle the least recently
+  // used unreferenced one if memory is short.
+  if((ip = kmem_cache_alloc(itable.cache)) != 0){
+    initsleeplock(&ip->lock, "inode");
+  } else {
+    if(itable.nunused == 0)
+      panic("iget: no inodes");
+    ip = itable.head.prev;
+    iunlru(ip);
+    iunhash(ip);
+  }
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->hnext = itable.hash[h];
+  itable.hash[h] = ip;
   release(&itable.lock);
 
   return ip;
@@ -323,8 +368,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode table entry can
-// be recycled.
+// If that was the last reference, the inode table entry joins
+// the LRU list and can be recycled.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -332,6 +377,8 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
+  struct inode *victim = 0;
+
   acquire(&itable.lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
@@ -353,8 +400,21 @@ iput(struct inode *ip)
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  if(--ip->ref == 0){
+    ip->next = itable.head.next;
+    ip->prev = &itable.head;
+    itable.head.next->prev = ip;
+    itable.head.next = ip;
+    if(++itable.nunused > NINODE){
+      victim = itable.head.prev;
+      iunlru(victim);
+      iunhash(victim);
+    }
+  }
   release(&itable.lock);
+
+  if(victim)
+    kmem_cache_free(itable.cache, victim);
 }
 
 // Common idiom: unlock, then put.
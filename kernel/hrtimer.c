@@ -0,0 +1,172 @@
+// High-resolution timers, each cpu's timer interrupt, and IPIs.
+//
+// Each cpu keeps a queue of the hrtimers added on it, soonest
+// first, and sets its CLINT mtimecmp for one interrupt at the
+// sooner of the queue's head and the end of its scheduler slice.
+// timervec in kernelvec.S disarms mtimecmp and passes the
+// interrupt on to hrtimerintr(), which runs the timers that are
+// due, ends the slice if it is over, advances the clock ticks,
+// and sets the next interrupt. An idle cpu has no slice; it
+// wakes for its hrtimers, and for clock ticks only while the
+// tick timer wheel has timers pending.
+// Times are values of the time CSR, which reads CLINT mtime.
+//
+// Interface:
+// * hrtimer_add(t, when) runs fn(arg) at time when, from a timer
+//   interrupt on this cpu, with no locks held. t must have been
+//   set up by timer_init() and must not be pending.
+// * hrtimer_del(t) cancels t, as timer_del() does.
+// * ipi(cpu) sends cpu a software interrupt, to wake it from wfi.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "timer.h"
+#include "defs.h"
+
+struct hart {
+  struct spinlock lock;
+  struct timer *head;        // pending hrtimers, soonest first
+  uint64 slice;              // time at which the current slice ends
+  int idle;                  // in the scheduler's idle(); no slice
+} harts[NCPU];
+
+void
+hrtimerinit(void)
+{
+  int i;
+
+  for(i = 0; i < NCPU; i++)
+    initlock(&harts[i].lock, "hrtimer");
+}
+
+// Set this cpu's next timer interrupt.
+// Caller holds h->lock.
+static void
+program(struct hart *h)
+{
+  uint64 when;
+
+  if(!h->idle)
+    when = h->slice;
+  else if(timer_npending())
+    when = clocknext();
+  else
+    when = ~0ULL;
+  if(h->head && h->head->expires < when)
+    when = h->head->expires;
+  *(uint64*)KCLINT_MTIMECMP(cpuid()) = when;
+}
+
+// Caller holds the lock of t's cpu.
+static void
+unlink(struct timer *t)
+{
+  if(t->next)
+    t->next->pprev = t->pprev;
+  *t->pprev = t->next;
+  t->next = 0;
+  t->pprev = 0;
+}
+
+void
+hrtimer_add(struct timer *t, uint64 when)
+{
+  struct hart *h;
+  struct timer **pp;
+
+  push_off();
+  h = &harts[cpuid()];
+  acquire(&h->lock);
+  if(t->pprev)
+    panic("hrtimer_add: pending");
+  t->expires = when;
+  t->cpu = cpuid();
+  for(pp = &h->head; *pp && (*pp)->expires <= when; pp = &(*pp)->next)
+    ;
+  t->next = *pp;
+  if(t->next)
+    t->next->pprev = &t->next;
+  t->pprev = pp;
+  *pp = t;
+  if(h->head == t)
+    program(h);
+  release(&h->lock);
+  pop_off();
+}
+
+int
+hrtimer_del(struct timer *t)
+{
+  struct hart *h = &harts[t->cpu];
+  int pending;
+
+  // an early interrupt for a deleted head is harmless,
+  // so the cpu's mtimecmp is left alone.
+  acquire(&h->lock);
+  pending = t->pprev != 0;
+  if(pending)
+    unlink(t);
+  release(&h->lock);
+  return pending;
+}
+
+// This cpu's timer interrupt, from devintr().
+// Returns 1 if the scheduler slice has ended.
+int
+hrtimerintr(void)
+{
+  struct hart *h = &harts[cpuid()];
+  struct timer *t;
+  void (*fn)(void*);
+  void *arg;
+  uint64 now;
+  int ended;
+
+  ended = 0;
+  acquire(&h->lock);
+  now = r_time();
+  if(h->slice == 0)
+    h->slice = now;  // first interrupt, set up by start.c
+  if(!h->idle && h->slice <= now){
+    h->slice = now + SLICE;
+    ended = 1;
+  }
+  while((t = h->head) != 0 && t->expires <= r_time()){
+    // t may be freed as soon as it is off the queue.
+    unlink(t);
+    fn = t->fn;
+    arg = t->arg;
+    release(&h->lock);
+    fn(arg);
+    acquire(&h->lock);
+  }
+  program(h);
+  release(&h->lock);
+
+  clockintr(r_time());
+  return ended;
+}
+
+// This cpu enters (on) or leaves the scheduler's idle loop.
+// Leaving starts a new slice.
+void
+hrtimer_idle(int on)
+{
+  struct hart *h = &harts[cpuid()];
+
+  acquire(&h->lock);
+  h->idle = on;
+  if(!on)
+    h->slice = r_time() + SLICE;
+  program(h);
+  release(&h->lock);
+}
+
+void
+ipi(int cpu)
+{
+  *(uint32*)KCLINT_MSIP(cpu) = 1;
+}
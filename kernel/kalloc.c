@@ -1,35 +1,77 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers.
+//
+// Underneath is a binary buddy allocator that hands out
+// physically contiguous blocks of 2^order pages, for
+// order 0..MAXORDER, and coalesces blocks with their buddies
+// when they are freed. Its free lists are threaded through
+// the page descriptors in pages[].
+//
+// kalloc() and kfree() are a fast path for single pages on top
+// of it: each CPU caches free pages on its own list, so they
+// normally touch only a CPU-local lock. An empty cache refills a
+// batch from the buddy allocator, or steals a batch from another
+// CPU when that is empty too; a cache that grows past KMEM_HIGH
+// returns a batch to the buddy allocator.
+//
+// Idle CPUs zero free pages in the background into a separate
+// pool, so that kalloc_zeroed() can usually skip the memset.
 
 #include "types.h"
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
 #include "riscv.h"
+#include "page.h"
 #include "defs.h"
 
+#define KMEM_BATCH 32   // pages moved per refill, steal or spill
+#define KMEM_HIGH  256  // spill when a CPU caches more than this
+#define ZPOOL_HIGH 256  // idle CPUs stop zeroing at this many pages
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
-unsigned char rc[(PHYSTOP >> 12) + 1];
-struct spinlock rc_lock;
+_Static_assert(sizeof(struct page) == 32, "struct page must be 32 bytes");
 
-struct run {
-  struct run *next;
-};
+struct page pages[NPAGE];
 
 struct {
   struct spinlock lock;
-  struct run *freelist;
-} kmem;
+  struct page *free[MAXORDER+1]; // free blocks of each order
+  int nfree[MAXORDER+1];
+} buddy;
+
+struct kmem {
+  struct spinlock lock;
+  struct page *freelist;
+  int nfree;          // pages on freelist
+  uint64 nhit;        // kalloc() satisfied from the local list
+  uint64 nrefill;     // batches taken from the buddy allocator
+  uint64 nsteal;      // batches stolen from another CPU
+  uint64 nspill;      // batches returned to the buddy allocator
+} __attribute__ ((aligned (64))) kmem[NCPU];
+
+// Free pages that idle CPUs have already filled with zeroes,
+// for kalloc_zeroed(). Linked through their descriptors.
+struct {
+  struct spinlock lock;
+  struct page *list;
+  int n;
+  uint64 nhit;        // kalloc_zeroed() served from the pool
+  uint64 nmiss;       // kalloc_zeroed() had to zero synchronously
+} zpool;
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  initlock(&buddy.lock, "buddy");
+  initlock(&zpool.lock, "zpool");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -42,6 +84,216 @@ freerange(void *pa_start, void *pa_end)
     kfree(p);
 }
 
+// Put the block headed by pg on the order's free list.
+// Caller holds buddy.lock.
+static void
+buddy_push(struct page *pg, int order)
+{
+  pg->flags = PG_FREE | PG_BUDDY;
+  pg->order = order;
+  pg->prev = 0;
+  pg->next = buddy.free[order];
+  if(pg->next)
+    pg->next->prev = pg;
+  buddy.free[order] = pg;
+  buddy.nfree[order]++;
+}
+
+// Take the free block headed by pg off its free list.
+// Caller holds buddy.lock.
+static void
+buddy_unlink(struct page *pg)
+{
+  int order = pg->order;
+
+  if(pg->prev)
+    pg->prev->next = pg->next;
+  else
+    buddy.free[order] = pg->next;
+  if(pg->next)
+    pg->next->prev = pg->prev;
+  pg->next = pg->prev = 0;
+  pg->flags = 0;
+  buddy.nfree[order]--;
+}
+
+// Allocate a block of 2^order pages, splitting a larger
+// block if needed. Caller holds buddy.lock.
+static struct page*
+buddy_alloc(int order)
+{
+  struct page *pg;
+  int k;
+
+  for(k = order; k <= MAXORDER && buddy.free[k] == 0; k++)
+    ;
+  if(k > MAXORDER)
+    return 0;
+  pg = buddy.free[k];
+  buddy_unlink(pg);
+  while(k > order){
+    k--;
+    buddy_push(pg + (1 << k), k);
+  }
+  pg->order = order;
+  return pg;
+}
+
+// Free the block of 2^order pages headed by pg, merging it
+// with its buddy for as long as the buddy is free too.
+// Caller holds buddy.lock.
+static void
+buddy_free(struct page *pg, int order)
+{
+  uint64 i, bi;
+  struct page *b;
+
+  i = pg - pages;
+  while(order < MAXORDER){
+    bi = i ^ (1L << order);
+    if(bi >= NPAGE)
+      break;
+    b = &pages[bi];
+    if((b->flags & PG_BUDDY) == 0 || b->order != order)
+      break;
+    buddy_unlink(b);
+    i &= ~(1L << order);
+    order++;
+  }
+  buddy_push(&pages[i], order);
+}
+
+// Detach up to n pages from the front of km's list.
+// Caller holds km->lock. Returns the detached chain,
+// sets *tail to its last element and *np to its length.
+static struct page*
+kmem_take(struct kmem *km, int n, struct page **tail, int *np)
+{
+  struct page *head, *pg;
+  int i;
+
+  head = km->freelist;
+  if(head == 0)
+    return 0;
+  pg = head;
+  for(i = 1; i < n && pg->next; i++)
+    pg = pg->next;
+  km->freelist = pg->next;
+  km->nfree -= i;
+  pg->next = 0;
+  *tail = pg;
+  *np = i;
+  return head;
+}
+
+// Prepend the chain head..tail of n pages to km's list.
+// Caller holds km->lock.
+static void
+kmem_put(struct kmem *km, struct page *head, struct page *tail, int n)
+{
+  struct page *pg;
+
+  for(pg = head; pg; pg = pg->next){
+    pg->flags = PG_FREE;
+    pg->cpu = km - kmem;
+  }
+  tail->next = km->freelist;
+  km->freelist = head;
+  km->nfree += n;
+}
+
+// Refill km's list with a batch of single pages from the
+// buddy allocator.
+// Called with interrupts off and without km->lock held.
+// Returns the number of pages moved.
+static int
+kmem_refill(struct kmem *km)
+{
+  struct page *head, *tail, *pg;
+  int n;
+
+  head = tail = 0;
+  acquire(&buddy.lock);
+  for(n = 0; n < KMEM_BATCH; n++){
+    if((pg = buddy_alloc(0)) == 0)
+      break;
+    pg->next = head;
+    head = pg;
+    if(tail == 0)
+      tail = pg;
+  }
+  release(&buddy.lock);
+  if(n == 0)
+    return 0;
+  acquire(&km->lock);
+  kmem_put(km, head, tail, n);
+  km->nrefill++;
+  release(&km->lock);
+  return n;
+}
+
+// Move a batch of pages from some other CPU's list onto km's.
+// Called with interrupts off and without km->lock held.
+// Returns the number of pages moved.
+static int
+kmem_steal(struct kmem *km)
+{
+  struct page *head, *tail;
+  struct kmem *victim;
+  int i, n;
+
+  for(i = 1; i < NCPU; i++){
+    victim = &kmem[((km - kmem) + i) % NCPU];
+    if(victim->nfree == 0)
+      continue;
+    acquire(&victim->lock);
+    head = kmem_take(victim, KMEM_BATCH, &tail, &n);
+    release(&victim->lock);
+    if(head == 0)
+      continue;
+    acquire(&km->lock);
+    kmem_put(km, head, tail, n);
+    km->nsteal++;
+    release(&km->lock);
+    return n;
+  }
+  return 0;
+}
+
+// Return up to n pages from km's list to the buddy allocator.
+// Called without km->lock held.
+static void
+kmem_spill(struct kmem *km, int n)
+{
+  struct page *head, *tail, *pg;
+
+  acquire(&km->lock);
+  head = kmem_take(km, n, &tail, &n);
+  if(head)
+    km->nspill++;
+  release(&km->lock);
+
+  acquire(&buddy.lock);
+  while((pg = head) != 0){
+    head = pg->next;
+    pg->next = 0;
+    buddy_free(pg, 0);
+  }
+  release(&buddy.lock);
+}
+
+// Return every CPU's cached pages to the buddy allocator,
+// so that they can coalesce into larger blocks.
+static void
+kmem_drain(void)
+{
+  struct kmem *km;
+
+  for(km = kmem; km < &kmem[NCPU]; km++)
+    if(km->nfree > 0)
+      kmem_spill(km, km->nfree);
+}
+
 // Free the page of physical memory pointed at by v,
 // which normally should have been returned by a
 // call to kalloc().  (The exception is when
@@ -49,24 +301,80 @@ freerange(void *pa_start, void *pa_end)
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct page *pg;
+  struct kmem *km;
+  int spill;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
-  if (*cow_refcount((uint64)pa) != 0){
-    printf("kfree: rc = %d", *cow_refcount((uint64)pa));
+  pg = pa2page(pa);
+  if(pg->flags & PG_FREE)
+    panic("kfree: double free");
+  if (pg->refcnt != 0){
+    printf("kfree: rc = %d", pg->refcnt);
     panic("kfree a mapped page");
   }
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
-  r = (struct run*)pa;
+  pg->private = 0;
+  pg->prev = 0;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  km = &kmem[cpuid()];
+  acquire(&km->lock);
+  pg->flags = PG_FREE;
+  pg->cpu = km - kmem;
+  pg->next = km->freelist;
+  km->freelist = pg;
+  km->nfree++;
+  spill = km->nfree > KMEM_HIGH;
+  release(&km->lock);
+  if(spill)
+    kmem_spill(km, KMEM_BATCH);
+  pop_off();
+}
+
+// Take one page off this CPU's cache, refilling or stealing
+// as needed. Returns its descriptor, or 0 if memory is exhausted.
+static struct page*
+kmem_alloc(void)
+{
+  struct page *pg;
+  struct kmem *km;
+
+  push_off();
+  km = &kmem[cpuid()];
+  for(;;){
+    acquire(&km->lock);
+    pg = km->freelist;
+    if(pg){
+      km->freelist = pg->next;
+      km->nfree--;
+      km->nhit++;
+    }
+    release(&km->lock);
+    if(pg || (kmem_refill(km) == 0 && kmem_steal(km) == 0))
+      break;
+  }
+  pop_off();
+
+  if(pg == 0){
+    // last resort: a page the idle loop already zeroed.
+    acquire(&zpool.lock);
+    if((pg = zpool.list) != 0){
+      zpool.list = pg->next;
+      zpool.n--;
+    }
+    release(&zpool.lock);
+  }
+  if(pg == 0)
+    return 0;
+  pg->next = 0;
+  pg->flags = 0;
+  pg->refcnt = 0;
+  return pg;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -75,32 +383,191 @@ kfree(void *pa)
 void *
 kalloc(void)
 {
-  struct run *r;
+  struct page *pg;
+  char *pa;
+
+  if((pg = kmem_alloc()) == 0)
+    return 0;
+  pa = (char*)page2pa(pg);
+  memset(pa, 5, PGSIZE); // fill with junk
+  return pa;
+}
+
+// Allocate one page of physical memory filled with zeroes.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  struct page *pg;
+  char *pa;
+
+  acquire(&zpool.lock);
+  if((pg = zpool.list) != 0){
+    zpool.list = pg->next;
+    zpool.n--;
+    zpool.nhit++;
+  } else {
+    zpool.nmiss++;
+  }
+  release(&zpool.lock);
+
+  if(pg){
+    pg->next = 0;
+    pg->flags = 0;
+    pg->refcnt = 0;
+    return (void*)page2pa(pg);
+  }
+
+  if((pg = kmem_alloc()) == 0)
+    return 0;
+  pa = (char*)page2pa(pg);
+  memset(pa, 0, PGSIZE);
+  return pa;
+}
+
+// Called by an idle CPU's scheduler loop. Zeroes one free
+// page into the pool if the pool is below ZPOOL_HIGH.
+// Returns 1 if it did any work.
+int
+kzero_idle(void)
+{
+  struct page *pg;
+
+  if(zpool.n >= ZPOOL_HIGH)
+    return 0;
+  if((pg = kmem_alloc()) == 0)
+    return 0;
+  memset((void*)page2pa(pg), 0, PGSIZE);
+
+  acquire(&zpool.lock);
+  pg->flags = PG_FREE | PG_ZERO;
+  pg->next = zpool.list;
+  zpool.list = pg;
+  zpool.n++;
+  release(&zpool.lock);
+  return 1;
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their size. Returns 0 if no such block is free.
+void *
+kalloc_pages(int order)
+{
+  struct page *pg;
+  char *pa;
+  int i;
+
+  if(order < 0 || order > MAXORDER)
+    panic("kalloc_pages");
+  if(order == 0)
+    return kalloc();
+
+  acquire(&buddy.lock);
+  pg = buddy_alloc(order);
+  release(&buddy.lock);
+  if(pg == 0){
+    // pages parked in the per-CPU caches may complete a block.
+    kmem_drain();
+    acquire(&buddy.lock);
+    pg = buddy_alloc(order);
+    release(&buddy.lock);
+  }
+  if(pg == 0)
+    return 0;
+
+  for(i = 0; i < (1 << order); i++){
+    pg[i].flags = 0;
+    pg[i].refcnt = 0;
+  }
+  pa = (char*)page2pa(pg);
+  memset(pa, 5, PGSIZE << order); // fill with junk
+  return pa;
+}
+
+// Free a block returned by kalloc_pages(order).
+void
+kfree_pages(void *pa, int order)
+{
+  struct page *pg;
+  int i;
+
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(order < 0 || order > MAXORDER ||
+     ((uint64)pa % (PGSIZE << order)) != 0 ||
+     (char*)pa < end || (uint64)pa + (PGSIZE << order) > PHYSTOP)
+    panic("kfree_pages");
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  pg = pa2page(pa);
+  for(i = 0; i < (1 << order); i++){
+    if(pg[i].flags & PG_FREE)
+      panic("kfree_pages: double free");
+    if(pg[i].refcnt != 0)
+      panic("kfree_pages: mapped page");
+    pg[i].private = 0;
+  }
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, PGSIZE << order);
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
-  *cow_refcount((uint64)r) = 0;
-  return (void *)r;
+  acquire(&buddy.lock);
+  buddy_free(pg, order);
+  release(&buddy.lock);
 }
 
-int cow_map(pte_t* pte_parent, pagetable_t child_pagetable, uint64 va) {
-  uint64 old_pte_parent = *pte_parent;
-  uint64 new_pte_parent = (old_pte_parent & ~PTE_W) | PTE_COW | PTE_R | PTE_X;
-  uint64 flags = PTE_FLAGS(new_pte_parent);
-  uint64 pa = PTE2PA(new_pte_parent);
-  if(mappages(child_pagetable, va, PGSIZE, pa, flags) != 0) {
-    return -1;
+// Print allocator counters. For debugging.
+void
+kallocdump(void)
+{
+  struct kmem *km;
+  int k;
+
+  for(km = kmem; km < &kmem[NCPU]; km++){
+    if(km->nhit == 0 && km->nfree == 0)
+      continue;
+    printf("kmem cpu%d: free %d hit %d refill %d steal %d spill %d\n",
+           (int)(km - kmem), km->nfree, (int)km->nhit, (int)km->nrefill,
+           (int)km->nsteal, (int)km->nspill);
   }
+  printf("zpool: free %d hit %d miss %d\n", zpool.n, (int)zpool.nhit,
+         (int)zpool.nmiss);
+  printf("buddy:");
+  for(k = 0; k <= MAXORDER; k++)
+    printf(" %d", buddy.nfree[k]);
+  printf("\n");
+}
+
+// Share the page the parent's PTE maps through the child's
+// empty PTE, leaving both read-only and copy-on-write.
+void cow_map(pte_t* pte_parent, pte_t* pte_child) {
+  uint64 new_pte_parent = (*pte_parent & ~PTE_W) | PTE_COW | PTE_R | PTE_X;
+  if (*pte_child & PTE_V)
+    panic("cow_map: remap");
+  cow_refinc(PTE2PA(new_pte_parent));
+  *pte_child = new_pte_parent;
   *pte_parent = new_pte_parent;
-  return 0;
 }
 
-unsigned char* cow_refcount(uint64 pa) {
-  return &rc[pa >> 12];
-}
\ No newline at end of file
+// Pages outside RAM (device registers) have no descriptor;
+// they report a single permanent reference.
+int cow_refcount(uint64 pa) {
+  if (pa < KERNBASE || pa >= PHYSTOP)
+    return 1;
+  return *(volatile uint*)&pa2page(pa)->refcnt;
+}
+
+// Add a mapping of pa. On RISC-V this is a single amoadd.w.
+void cow_refinc(uint64 pa) {
+  if (pa < KERNBASE || pa >= PHYSTOP)
+    return;
+  __sync_fetch_and_add(&pa2page(pa)->refcnt, 1);
+}
+
+// Drop a mapping of pa and return the remaining count.
+// Exactly one caller sees 0, and it owns freeing the page.
+int cow_refdec(uint64 pa) {
+  if (pa < KERNBASE || pa >= PHYSTOP)
+    return 1;
+  return __sync_sub_and_fetch(&pa2page(pa)->refcnt, 1);
+}
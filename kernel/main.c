@@ -17,16 +17,23 @@ main()
     printf("xv6 kernel is booting\n");
     printf("\n");
     kinit();         // physical page allocator
+    slabinit();      // kernel object caches
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
+#ifdef STRINGBENCH
+    stringbench();   // time string.c
+#endif
     procinit();      // process table
     trapinit();      // trap vectors
+    timerwheelinit(); // timer wheel
+    hrtimerinit();   // per-cpu timer queues
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
     iinit();         // inode table
     fileinit();      // file table
+    pipeinit();      // pipe cache
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
     __sync_synchronize();
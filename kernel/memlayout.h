@@ -27,9 +27,16 @@
 
 // core local interruptor (CLINT), which contains the timer.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid))
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
 
+// the CLINT lies below USERTOP, so the kernel maps it
+// elsewhere, after the PLIC.
+#define KCLINT 0x0e000000L
+#define KCLINT_MSIP(hartid) (KCLINT + 4*(hartid))
+#define KCLINT_MTIMECMP(hartid) (KCLINT + 0x4000 + 8*(hartid))
+
 // qemu puts platform-level interrupt controller (PLIC) here.
 #define PLIC 0x0c000000L
 #define PLIC_PRIORITY (PLIC + 0x0)
@@ -65,3 +72,8 @@
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// a process's kernel page table shares the first 1GB of its user
+// page table, which therefore also maps the devices below 1GB
+// (for the kernel only); user memory must end before them.
+#define USERTOP PLIC
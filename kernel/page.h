@@ -0,0 +1,32 @@
+// Physical page frame descriptors.
+//
+// One struct page per 4096-byte page of RAM in [KERNBASE, PHYSTOP),
+// indexed by page frame number, so any subsystem can find a frame's
+// metadata in O(1) from its physical address. Each descriptor is
+// 32 bytes: two share a 64-byte cache line and none straddles one.
+// For 128MB of RAM the table costs 1MB, about 0.8%.
+
+struct page {
+  struct page *next;  // links for whichever list owns the frame
+  struct page *prev;
+  uint64 private;     // owner-specific data
+  uint refcnt;        // page-table mappings; updated atomically
+  ushort flags;       // PG_* below
+  uchar order;        // block order, for buddy blocks
+  uchar cpu;          // free list the frame sits on, when PG_FREE
+};
+
+#define PG_FREE  (1 << 0) // on an allocator free list
+#define PG_BUDDY (1 << 1) // heads a free block in the buddy allocator
+#define PG_SLAB  (1 << 2) // slab page; private is its kmem_cache
+#define PG_ZERO  (1 << 3) // free page known to hold only zeroes
+
+#define MAXORDER 10       // largest buddy block: 2^10 pages (4MB)
+
+#define NPAGE ((PHYSTOP - KERNBASE) >> PGSHIFT)
+
+extern struct page pages[NPAGE];
+
+// pa must lie in [KERNBASE, PHYSTOP).
+#define pa2page(pa) (&pages[((uint64)(pa) - KERNBASE) >> PGSHIFT])
+#define page2pa(pg) (KERNBASE + ((uint64)((pg) - pages) << PGSHIFT))
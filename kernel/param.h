@@ -1,8 +1,7 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // unreferenced i-nodes kept cached
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
@@ -11,3 +10,9 @@
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       1000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define COWEAGER     16  // hot pages fork copies for the child up front
+#define COWAROUND     4  // neighbours a COW fault resolves on each side
+#define PIPEBUFS      4  // pages of data a pipe holds; a power of 2
+#define TIMEFREQ  10000000  // time CSR (CLINT mtime) counts per second in qemu
+#define SLICE  (TIMEFREQ/100)  // scheduler time slice, in time counts
+#define TICK   (TIMEFREQ/10)  // clock tick (uptime(), sleep()), in time counts
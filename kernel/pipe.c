@@ -8,17 +8,48 @@
 #include "sleeplock.h"
 #include "file.h"
 
-#define PIPESIZE 512
+// A pipe is a ring of up to PIPEBUFS buffers, each holding the
+// unread bytes [off, off+len) of a page. pipewrite() copies into
+// the last buffer while its page has room, and then starts a new
+// buffer on a fresh page. pipepush() appends a page the caller
+// already holds, by reference: data spliced from a file, or user
+// pages given by vmsplice(). Such a gift is never appended to.
+//
+// Buffer pages are counted in their struct page's refcnt, like
+// mapped user pages, so one page can be in a pipe and mapped
+// copy-on-write in a process at once; whoever drops the last
+// reference frees it. An emptied page the pipe held alone is kept
+// as a spare for the next buffer.
+//
+// A reader sleeps only when no buffer holds data and a writer only
+// when every buffer is in use, so each side wakes the other only
+// when it ends that state.
+
+struct pipebuf {
+  char *page;
+  uint off;       // first unread byte
+  uint len;       // unread bytes; never 0 in a live buffer
+  int gift;       // page came from pipepush(): do not append
+};
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
-  uint nread;     // number of bytes read
-  uint nwrite;    // number of bytes written
+  struct pipebuf buf[PIPEBUFS];
+  uint nread;     // number of buffers emptied
+  uint nwrite;    // number of buffers started
+  char *spare;    // an emptied page, for the next buffer
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
 };
 
+struct kmem_cache *pipecache;
+
+void
+pipeinit(void)
+{
+  pipecache = kmem_cache_create("pipe", sizeof(struct pipe));
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,12 +59,13 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = kmem_cache_alloc(pipecache)) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
+  pi->spare = 0;
   initlock(&pi->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
@@ -47,7 +79,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    kmem_cache_free(pipecache, pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -55,6 +87,19 @@ pipealloc(struct file **f0, struct file **f1)
   return -1;
 }
 
+// Drop the pipe's reference to a buffer's page.
+// Caller holds pi->lock.
+static void
+pipeput(struct pipe *pi, char *page)
+{
+  if(cow_refdec((uint64)page) != 0)
+    return;
+  if(pi->spare == 0)
+    pi->spare = page;
+  else
+    kfree(page);
+}
+
 void
 pipeclose(struct pipe *pi, int writable)
 {
@@ -67,16 +112,37 @@ pipeclose(struct pipe *pi, int writable)
     wakeup(&pi->nwrite);
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
+    for(; pi->nread != pi->nwrite; pi->nread++)
+      pipeput(pi, pi->buf[pi->nread % PIPEBUFS].page);
+    if(pi->spare)
+      kfree(pi->spare);
     release(&pi->lock);
-    kfree((char*)pi);
+    kmem_cache_free(pipecache, pi);
   } else
     release(&pi->lock);
 }
 
+// The buffer a write can append to: the last one, if the
+// pipe owns its page and the page has room. Else 0.
+static struct pipebuf*
+pipelast(struct pipe *pi)
+{
+  struct pipebuf *b;
+
+  if(pi->nwrite == pi->nread)
+    return 0;
+  b = &pi->buf[(pi->nwrite - 1) % PIPEBUFS];
+  if(b->gift || b->off + b->len == PGSIZE)
+    return 0;
+  return b;
+}
+
 int
 pipewrite(struct pipe *pi, uint64 addr, int n)
 {
   int i = 0;
+  uint m;
+  struct pipebuf *b;
   struct proc *pr = myproc();
 
   acquire(&pi->lock);
@@ -85,46 +151,205 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
       release(&pi->lock);
       return -1;
     }
-    if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
-      wakeup(&pi->nread);
-      sleep(&pi->nwrite, &pi->lock);
-    } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+    if((b = pipelast(pi)) == 0){
+      if(pi->nwrite == pi->nread + PIPEBUFS){ //DOC: pipewrite-full
+        sleep(&pi->nwrite, &pi->lock);
+        continue;
+      }
+      // start a new buffer; it goes live below, once it has data.
+      b = &pi->buf[pi->nwrite % PIPEBUFS];
+      if((b->page = pi->spare) == 0 && (b->page = kalloc()) == 0)
         break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+      pi->spare = 0;
+      cow_refinc((uint64)b->page);
+      b->off = b->len = 0;
+      b->gift = 0;
     }
+    // as much as the page has room for.
+    m = PGSIZE - (b->off + b->len);
+    if(m > n - i)
+      m = n - i;
+    if(copyin(pr->pagetable, b->page + b->off + b->len, addr + i, m) == -1){
+      if(b->len == 0)
+        pipeput(pi, b->page);
+      break;
+    }
+    if(pi->nwrite == pi->nread)
+      wakeupone(&pi->nread);  // no longer empty
+    if(b->len == 0)
+      pi->nwrite++;
+    b->len += m;
+    i += m;
   }
-  wakeup(&pi->nread);
   release(&pi->lock);
 
   return i;
 }
 
+// Wait for data or for the last writer to go.
+// Returns 0 when there is data or end of file, -1 if killed.
+// Caller holds pi->lock.
+static int
+pipewait(struct pipe *pi)
+{
+  struct proc *pr = myproc();
+
+  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
+    if(pr->killed)
+      return -1;
+    sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
+  }
+  return 0;
+}
+
+// Readers are woken one at a time, so one that leaves data
+// behind wakes the next. Caller holds pi->lock.
+static void
+pipenext(struct pipe *pi)
+{
+  if(pi->nread != pi->nwrite)
+    wakeupone(&pi->nread);
+}
+
+// Done with the front buffer. Caller holds pi->lock.
+static void
+pipepop(struct pipe *pi)
+{
+  if(pi->nwrite == pi->nread + PIPEBUFS)
+    wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  pi->nread++;
+}
+
 int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
   int i;
+  uint m;
+  struct pipebuf *b;
   struct proc *pr = myproc();
-  char ch;
 
   acquire(&pi->lock);
-  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
-    if(pr->killed){
-      release(&pi->lock);
-      return -1;
-    }
-    sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
+  if(pipewait(pi) < 0){
+    release(&pi->lock);
+    return -1;
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
-      break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+  for(i = 0; i < n && pi->nread != pi->nwrite; i += m){  //DOC: piperead-copy
+    b = &pi->buf[pi->nread % PIPEBUFS];
+    m = b->len;
+    if(m > n - i)
+      m = n - i;
+    if(copyout(pr->pagetable, addr + i, b->page + b->off, m) == -1)
       break;
+    b->off += m;
+    b->len -= m;
+    if(b->len == 0){
+      pipeput(pi, b->page);
+      pipepop(pi);
+    }
   }
-  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  pipenext(pi);
   release(&pi->lock);
   return i;
 }
+
+// Take up to n bytes from the front of the pipe by reference:
+// *page gets a reference to the page they lie in, at *off.
+// Waits for data like piperead(). Returns the number of bytes,
+// 0 at end of file, or -1.
+int
+pipetake(struct pipe *pi, int n, char **page, uint *off)
+{
+  uint m;
+  struct pipebuf *b;
+
+  acquire(&pi->lock);
+  if(pipewait(pi) < 0){
+    release(&pi->lock);
+    return -1;
+  }
+  if(pi->nread == pi->nwrite){
+    release(&pi->lock);
+    return 0;
+  }
+  b = &pi->buf[pi->nread % PIPEBUFS];
+  *page = b->page;
+  *off = b->off;
+  if(b->len <= n){
+    // the whole buffer, and the pipe's reference with it.
+    m = b->len;
+    pipepop(pi);
+  } else {
+    // the front of it; the pipe may still append past
+    // the end, which the caller does not look at.
+    m = n;
+    cow_refinc((uint64)b->page);
+    b->off += m;
+    b->len -= m;
+  }
+  pipenext(pi);
+  release(&pi->lock);
+  return m;
+}
+
+// Append the n bytes at page+off to the pipe by reference,
+// handing the pipe the caller's reference to page. Waits for a
+// free buffer like pipewrite(). Returns 0, or -1 if the pipe has
+// no reader, in which case the reference is dropped.
+int
+pipepush(struct pipe *pi, char *page, uint off, uint n)
+{
+  struct pipebuf *b;
+  struct proc *pr = myproc();
+
+  acquire(&pi->lock);
+  while(pi->nwrite == pi->nread + PIPEBUFS && pi->readopen && !pr->killed)
+    sleep(&pi->nwrite, &pi->lock);
+  if(pi->readopen == 0 || pr->killed){
+    pipeput(pi, page);
+    release(&pi->lock);
+    return -1;
+  }
+  if(pi->nwrite == pi->nread)
+    wakeupone(&pi->nread);
+  b = &pi->buf[pi->nwrite++ % PIPEBUFS];
+  b->page = page;
+  b->off = off;
+  b->len = n;
+  b->gift = 1;
+  release(&pi->lock);
+  return 0;
+}
+
+// Give the user pages in [addr, addr+n) to the pipe. Whole,
+// page-aligned pages go in by reference and become copy-on-write
+// for the caller (see uvmgift()); the ragged ends are copied.
+// Returns the number of bytes given, or -1.
+int
+pipevmsplice(struct pipe *pi, uint64 addr, int n)
+{
+  struct proc *p = myproc();
+  uint64 pa;
+  int i, m, r;
+
+  if(addr + n < addr || addr + n > p->sz)
+    return -1;
+  for(i = 0; i < n; i += m){
+    if((addr + i) % PGSIZE != 0 || n - i < PGSIZE){
+      m = PGSIZE - (addr + i) % PGSIZE;
+      if(m > n - i)
+        m = n - i;
+      if((r = pipewrite(pi, addr + i, m)) != m){
+        if(r > 0)
+          i += r;
+        break;
+      }
+    } else {
+      m = PGSIZE;
+      if((pa = uvmgift(p->pagetable, addr + i)) == 0)
+        break;
+      if(pipepush(pi, (char*)pa, 0, PGSIZE) < 0)
+        break;
+    }
+  }
+  return i > 0 ? i : -1;
+}
@@ -4,6 +4,7 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "timer.h"
 #include "defs.h"
 
 struct cpu cpus[NCPU];
@@ -15,6 +16,39 @@ struct proc *initproc;
 int nextpid = 1;
 struct spinlock pid_lock;
 
+// UNUSED proc entries, linked through p->nextfree,
+// so that allocproc() need not scan proc[].
+struct {
+  struct spinlock lock;
+  struct proc *head;
+} procfree;
+
+// RUNNABLE procs, queued on the cpu they last ran on.
+// Each cpu runs its own queue's head, and steals from
+// the longest other queue when its own is empty.
+// Lock order: p->lock, then a runq lock.
+struct runq {
+  struct spinlock lock;
+  struct proc *head;
+  struct proc *tail;
+  int n;
+  uint64 nsteal;               // procs this cpu took from other queues
+} runq[NCPU];
+
+// cpus waiting in idle() for work, one bit each.
+uint64 idlemask;
+
+// SLEEPING procs, hashed by channel, so that wakeup() only
+// looks at procs that may be sleeping on its channel. Each
+// queue is in the order its procs went to sleep.
+// Lock order: a waitq lock, then p->lock.
+#define NWAITQ 61
+
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;
+} waitq[NWAITQ];
+
 extern void forkret(void);
 static void freeproc(struct proc *p);
 
@@ -47,12 +81,20 @@ void
 procinit(void)
 {
   struct proc *p;
+  int i;
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
-  for(p = proc; p < &proc[NPROC]; p++) {
+  initlock(&procfree.lock, "procfree");
+  for(i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(i = 0; i < NWAITQ; i++)
+    initlock(&waitq[i].lock, "waitq");
+  for(p = &proc[NPROC-1]; p >= proc; p--) {
       initlock(&p->lock, "proc");
       p->kstack = KSTACK((int) (p - proc));
+      p->nextfree = procfree.head;
+      procfree.head = p;
   }
 }
 
@@ -97,7 +139,7 @@ allocpid() {
   return pid;
 }
 
-// Look in the process table for an UNUSED proc.
+// Take an UNUSED proc off the free list.
 // If found, initialize state required to run in the kernel,
 // and return with p->lock held.
 // If there are no free procs, or a memory allocation fails, return 0.
@@ -106,19 +148,22 @@ allocproc(void)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
-    }
-  }
-  return 0;
+  acquire(&procfree.lock);
+  p = procfree.head;
+  if(p)
+    procfree.head = p->nextfree;
+  release(&procfree.lock);
+  if(p == 0)
+    return 0;
 
-found:
+  acquire(&p->lock);
+  if(p->state != UNUSED)
+    panic("allocproc");
   p->pid = allocpid();
   p->state = USED;
+  p->asid = 0;
+  p->lastcpu = -1;
+  p->ncowfault = p->ncowcopy = p->ncowreuse = 0;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -135,6 +180,14 @@ found:
     return 0;
   }
 
+  // A kernel page table that also maps the user memory.
+  p->kpagetable = kvmcreate(p->pagetable);
+  if(p->kpagetable == 0){
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
+
   // Set up new context to start executing at forkret,
   // which returns to user space.
   memset(&p->context, 0, sizeof(p->context));
@@ -153,6 +206,9 @@ freeproc(struct proc *p)
   // if(p->trapframe)
   //   kfree((void*)p->trapframe);
   p->trapframe = 0;
+  if(p->kpagetable)
+    kfree((void*)p->kpagetable);  // its mappings are all borrowed
+  p->kpagetable = 0;
   if(p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
@@ -164,6 +220,11 @@ freeproc(struct proc *p)
   p->killed = 0;
   p->xstate = 0;
   p->state = UNUSED;
+
+  acquire(&procfree.lock);
+  p->nextfree = procfree.head;
+  procfree.head = p;
+  release(&procfree.lock);
 }
 
 // Create a user page table for a given process,
@@ -221,6 +282,101 @@ uchar initcode[] = {
   0x00, 0x00, 0x00, 0x00
 };
 
+// Make p RUNNABLE and queue it on the cpu it last ran
+// on, or on this cpu if it has not run yet.
+// Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+  struct runq *rq;
+  uint64 mask;
+  int id;
+
+  p->state = RUNNABLE;
+  id = p->lastcpu >= 0 ? p->lastcpu : cpuid();
+  rq = &runq[id];
+  acquire(&rq->lock);
+  p->rqnext = 0;
+  if(rq->tail)
+    rq->tail->rqnext = p;
+  else
+    rq->head = p;
+  rq->tail = p;
+  rq->n++;
+  release(&rq->lock);
+
+  // wake the queue's cpu if it is idle, else any idle
+  // cpu, which will steal p. queue before looking at
+  // idlemask; idle() does the opposite.
+  __sync_synchronize();
+  if((mask = idlemask) != 0){
+    if((mask & (1UL << id)) == 0)
+      for(id = 0; (mask & (1UL << id)) == 0; id++)
+        ;
+    ipi(id);
+  }
+}
+
+static struct proc*
+runqpop(struct runq *rq)
+{
+  struct proc *p;
+
+  acquire(&rq->lock);
+  if((p = rq->head) != 0){
+    rq->head = p->rqnext;
+    if(rq->head == 0)
+      rq->tail = 0;
+    rq->n--;
+  }
+  release(&rq->lock);
+  return p;
+}
+
+// Take the next proc for cpu id to run: the head of its
+// own queue, else the head of the longest other queue.
+// Queue lengths are peeked at without locks.
+static struct proc*
+runqget(int id)
+{
+  struct proc *p;
+  int i, best;
+
+  if(runq[id].n > 0 && (p = runqpop(&runq[id])) != 0)
+    return p;
+  best = -1;
+  for(i = 0; i < NCPU; i++)
+    if(i != id && runq[i].n > 0 && (best < 0 || runq[i].n > runq[best].n))
+      best = i;
+  if(best < 0 || (p = runqpop(&runq[best])) == 0)
+    return 0;
+  runq[id].nsteal++;
+  return p;
+}
+
+// Wait for an interrupt with this cpu's scheduler slice
+// off, unless some run queue has work. setrunnable() sends
+// an idle cpu an IPI when it queues work.
+static void
+idle(void)
+{
+  uint64 bit;
+  int i;
+
+  intr_off();
+  bit = 1UL << cpuid();
+  __sync_fetch_and_or(&idlemask, bit);
+  for(i = 0; i < NCPU; i++)
+    if(runq[i].n > 0)
+      break;
+  if(i == NCPU){
+    hrtimer_idle(1);
+    wfi();
+    hrtimer_idle(0);
+  }
+  __sync_fetch_and_and(&idlemask, ~bit);
+}
+
 // Set up first user process.
 void
 userinit(void)
@@ -242,7 +398,7 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
@@ -252,15 +408,19 @@ userinit(void)
 int
 growproc(int n)
 {
-  uint sz;
+  uint64 sz;
   struct proc *p = myproc();
 
+  // growing only reserves the range; usertrap() fills in
+  // each page on first touch.
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    if(sz + n > USERTOP)
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
+    if(-(uint64)n > sz)
+      return -1;
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
   p->sz = sz;
@@ -312,7 +472,54 @@ fork(void)
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  setrunnable(np);
+  release(&np->lock);
+
+  return pid;
+}
+
+// Create a process running the program at path with argv,
+// without copying the caller's memory: the child's image is
+// built directly by execp(). The child's file descriptors 0,
+// 1 and 2 are files[0..2], any of which may be null; it
+// inherits no others. Returns the child's pid, or -1.
+int
+spawn(char *path, char **argv, struct file **files)
+{
+  int i, pid, argc;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  if((np = allocproc()) == 0){
+    return -1;
+  }
+  memset(np->trapframe, 0, sizeof(*np->trapframe));
+
+  // no one else looks at a USED proc, and loading the
+  // program may sleep.
+  release(&np->lock);
+
+  if((argc = execp(np, path, argv)) < 0){
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  np->trapframe->a0 = argc;
+
+  for(i = 0; i < 3; i++)
+    if(files[i])
+      np->ofile[i] = filedup(files[i]);
+  np->cwd = idup(p->cwd);
+
+  pid = np->pid;
+
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
@@ -445,22 +652,40 @@ scheduler(void)
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-      }
-      release(&p->lock);
+    push_off();
+    p = runqget(cpuid());
+    pop_off();
+    if(p == 0){
+      // Nothing to run: zero a free page for kalloc_zeroed(),
+      // or if there are enough, wait for work.
+      if(!kzero_idle())
+        idle();
+      continue;
     }
+
+    // Waits for p's previous cpu, if p just yielded
+    // or was woken, to finish swtch()ing away from it.
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler: queued proc not runnable");
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    c->proc = p;
+    kvmactivate(p);
+    // a process preempted in the middle of a user copy left
+    // SUM set; its own kerneltrap() sets it again on return.
+    w_sstatus(r_sstatus() & ~SSTATUS_SUM);
+    swtch(&c->context, &p->context);
+    // off p's page tables before anyone can free them.
+    kvmactivate(0);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
@@ -497,7 +722,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -523,26 +748,48 @@ forkret(void)
   usertrapret();
 }
 
-// Atomically release lock and sleep on chan.
+static struct waitq*
+chanq(void *chan)
+{
+  return &waitq[(uint64)chan % NWAITQ];
+}
+
+// Atomically release lock and sleep on chan, first adding
+// timer t with add(t, when) if t is not 0. lk may be 0 if
+// only the timer will wake the caller.
 // Reacquires lock when awakened.
-void
-sleep(void *chan, struct spinlock *lk)
+static void
+sleep1(void *chan, struct spinlock *lk, struct timer *t,
+       void (*add)(struct timer*, uint64), uint64 when)
 {
   struct proc *p = myproc();
+  struct waitq *wq = chanq(chan);
+  struct proc **pp;
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold chan's waitq lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks it),
   // so it's okay to release lk.
 
-  acquire(&p->lock);  //DOC: sleeplock1
-  release(lk);
+  acquire(&wq->lock);  //DOC: sleeplock1
+  acquire(&p->lock);
+  if(lk)
+    release(lk);
+
+  // t cannot wake p before p is asleep: it needs p->lock.
+  if(t)
+    add(t, when);
 
-  // Go to sleep.
+  // Go to sleep, at the tail of chan's queue.
   p->chan = chan;
   p->state = SLEEPING;
+  p->wqnext = 0;
+  for(pp = &wq->head; *pp; pp = &(*pp)->wqnext)
+    ;
+  *pp = p;
+  release(&wq->lock);
 
   sched();
 
@@ -551,7 +798,94 @@ sleep(void *chan, struct spinlock *lk)
 
   // Reacquire original lock.
   release(&p->lock);
-  acquire(lk);
+  if(lk)
+    acquire(lk);
+}
+
+void
+sleep(void *chan, struct spinlock *lk)
+{
+  sleep1(chan, lk, 0, 0, 0);
+}
+
+static void unsleep(struct proc*);
+
+static void
+sleepexpire(void *p)
+{
+  unsleep(p);
+}
+
+// Like sleep(), but give up after n clock ticks.
+// Returns 0 if woken, -1 if the time ran out.
+int
+sleeptimeout(void *chan, struct spinlock *lk, int n)
+{
+  struct timer t;
+
+  timer_init(&t, sleepexpire, myproc());
+  sleep1(chan, lk, &t, timer_add, n);
+  return timer_del(&t) ? 0 : -1;
+}
+
+// Sleep until the time CSR reaches when.
+// Returns 0, or -1 if killed first.
+int
+sleepuntil(uint64 when)
+{
+  struct proc *p = myproc();
+  struct timer t;
+
+  timer_init(&t, sleepexpire, p);
+  while(r_time() < when){
+    if(p->killed)
+      return -1;
+    // no one else knows t, so only its firing or
+    // kill() can wake p.
+    sleep1(&t, 0, &t, hrtimer_add, when);
+    hrtimer_del(&t);
+  }
+  return 0;
+}
+
+// Wake the procs on wq that are sleeping on chan, or only
+// the one that has slept longest if one is set; if p is not
+// 0, only p. A proc's chan does not change while it is
+// queued. Must be called without any p->lock.
+static void
+wakeq(struct waitq *wq, void *chan, struct proc *p, int one)
+{
+  struct proc **pp, *q;
+
+  acquire(&wq->lock);
+  for(pp = &wq->head; (q = *pp) != 0; ){
+    if(q->chan != chan || (p && q != p)){
+      pp = &q->wqnext;
+      continue;
+    }
+    *pp = q->wqnext;
+    // waits for q to finish going to sleep.
+    acquire(&q->lock);
+    setrunnable(q);
+    release(&q->lock);
+    if(one)
+      break;
+  }
+  release(&wq->lock);
+}
+
+// Wake p if it is sleeping, on whatever channel.
+// Must be called without any p->lock.
+static void
+unsleep(struct proc *p)
+{
+  void *chan;
+
+  acquire(&p->lock);
+  chan = p->state == SLEEPING ? p->chan : 0;
+  release(&p->lock);
+  if(chan)
+    wakeq(chanq(chan), chan, p, 1);
 }
 
 // Wake up all processes sleeping on chan.
@@ -559,17 +893,17 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
-  struct proc *p;
+  wakeq(chanq(chan), chan, 0, 0);
+}
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
-      acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-    }
-  }
+// Wake up the process that has slept longest on chan, for
+// channels where any one waiter can make progress and wakes
+// the next if it leaves work behind.
+// Must be called without any p->lock.
+void
+wakeupone(void *chan)
+{
+  wakeq(chanq(chan), chan, 0, 1);
 }
 
 // Kill the process with the given pid.
@@ -584,11 +918,9 @@ kill(int pid)
     acquire(&p->lock);
     if(p->pid == pid){
       p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
       release(&p->lock);
+      // Wake process from sleep().
+      unsleep(p);
       return 0;
     }
     release(&p->lock);
@@ -626,7 +958,8 @@ either_copyin(void *dst, int user_src, uint64 src, uint64 len)
   }
 }
 
-// Print a process listing to console.  For debugging.
+// Print a process listing and allocator counters to console.
+// For debugging.
 // Runs when user types ^P on console.
 // No lock to avoid wedging a stuck machine further.
 void
@@ -641,6 +974,8 @@ procdump(void)
   };
   struct proc *p;
   char *state;
+  uint64 nsys;
+  int i;
 
   printf("\n");
   for(p = proc; p < &proc[NPROC]; p++){
@@ -651,6 +986,19 @@ procdump(void)
     else
       state = "???";
     printf("%d %s %s", p->pid, state, p->name);
+    printf(" cow %d copy %d reuse %d", (int)p->ncowfault, (int)p->ncowcopy,
+           (int)p->ncowreuse);
     printf("\n");
   }
+  kallocdump();
+  slabdump();
+  cowdump();
+  nsys = 0;
+  for(i = 0; i < NCPU; i++)
+    nsys += cpus[i].nsyscall;
+  printf("syscalls %d\n", (int)nsys);
+  for(i = 0; i < NCPU; i++)
+    if(runq[i].n || runq[i].nsteal)
+      printf("runq %d: queued %d stolen %d\n", i, runq[i].n,
+             (int)runq[i].nsteal);
 }
@@ -24,6 +24,8 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asidgen;             // ASID generation this cpu's TLB is clean for
+  uint64 nsyscall;            // System calls made on this cpu.
 };
 
 extern struct cpu cpus[NCPU];
@@ -96,10 +98,25 @@ struct proc {
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
 
+  // procfree.lock must be held when using this:
+  struct proc *nextfree;       // Next UNUSED proc
+
+  // the run queue's lock must be held when using this:
+  struct proc *rqnext;         // Next RUNNABLE proc on the same queue
+
+  // the wait queue's lock must be held when using this:
+  struct proc *wqnext;         // Next SLEEPING proc on the same queue
+
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
+  pagetable_t kpagetable;      // Kernel page table, mapping user memory too
+  uint64 asid;                 // ASID and its generation; see asid_activate()
+  int lastcpu;                 // cpu this process last ran user code on
+  uint64 ncowfault;            // COW write faults taken
+  uint64 ncowcopy;             // ... resolved by copying the page
+  uint64 ncowreuse;            // ... resolved by reusing it in place
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
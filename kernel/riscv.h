@@ -46,6 +46,9 @@ w_mepc(uint64 x)
 
 // Supervisor Status Register, sstatus
 
+#define SSTATUS_SUM (1L << 18) // Supervisor may access User pages
+#define SSTATUS_VS (3L << 9)   // Vector unit state; 0 is off
+#define SSTATUS_VS_INITIAL (1L << 9) // vector unit on, state clean
 #define SSTATUS_SPP (1L << 8)  // Previous mode, 1=Supervisor, 0=User
 #define SSTATUS_SPIE (1L << 5) // Supervisor Previous Interrupt Enable
 #define SSTATUS_UPIE (1L << 4) // User Previous Interrupt Enable
@@ -202,7 +205,11 @@ w_pmpaddr0(uint64 x)
 // use riscv's sv39 page table scheme.
 #define SATP_SV39 (8L << 60)
 
-#define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK 0xFFFFL
+
+#define MAKE_SATP(pagetable, asid) \
+  (SATP_SV39 | ((uint64)(asid) << SATP_ASID_SHIFT) | (((uint64)pagetable) >> 12))
 
 // supervisor address translation and protection;
 // holds the address of the page table.
@@ -275,6 +282,15 @@ r_time()
   return x;
 }
 
+// cycles executed by this hart
+static inline uint64
+r_cycle()
+{
+  uint64 x;
+  asm volatile("csrr %0, cycle" : "=r" (x) );
+  return x;
+}
+
 // enable device interrupts
 static inline void
 intr_on()
@@ -297,6 +313,14 @@ intr_get()
   return (x & SSTATUS_SIE) != 0;
 }
 
+// wait until an interrupt is pending, even with
+// device interrupts disabled.
+static inline void
+wfi()
+{
+  asm volatile("wfi");
+}
+
 static inline uint64
 r_sp()
 {
@@ -337,6 +361,20 @@ sfence_vma()
   asm volatile("sfence.vma zero, zero");
 }
 
+// flush the TLB entries of one address space.
+static inline void
+sfence_vma_asid(uint64 asid)
+{
+  asm volatile("sfence.vma zero, %0" : : "r" (asid));
+}
+
+// flush the TLB entry for one page of one address space.
+static inline void
+sfence_vma_page(uint64 va, uint64 asid)
+{
+  asm volatile("sfence.vma %0, %1" : : "r" (va), "r" (asid));
+}
+
 
 #define PGSIZE 4096 // bytes per page
 #define PGSHIFT 12  // bits of offset within a page
@@ -344,12 +382,20 @@ sfence_vma()
 #define PGROUNDUP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1))
 #define PGROUNDDOWN(a) (((a)) & ~(PGSIZE-1))
 
+#define MEGAPGSIZE (1L << PXSHIFT(1)) // bytes per level-1 megapage (2MB)
+#define MEGAPGROUNDDOWN(a) (((a)) & ~(MEGAPGSIZE-1))
+
 #define PTE_V (1L << 0) // valid
 #define PTE_R (1L << 1)
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // 1 -> user can access
+#define PTE_G (1L << 5) // global: the same in every address space
+#define PTE_A (1L << 6) // accessed, set by the hardware
+#define PTE_D (1L << 7) // dirty, set by the hardware
 #define PTE_COW (1L << 8)
+#define PTE_HOT (1L << 9) // made writable before any write fault asked
+#define PTE_GUARD (1L << 54) // with PTE_V clear: a guard page, never filled in
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
@@ -358,6 +404,10 @@ sfence_vma()
 
 #define PTE_FLAGS(pte) ((pte) & 0x3FF)
 
+// a valid PTE with any of R/W/X set is a leaf; otherwise it
+// points to the next level's page-table page.
+#define PTE_LEAF(pte) ((pte) & (PTE_R|PTE_W|PTE_X))
+
 // extract the three 9-bit page table indices from a virtual address.
 #define PXMASK          0x1FF // 9 bits
 #define PXSHIFT(level)  (PGSHIFT+(9*(level)))
@@ -0,0 +1,235 @@
+// Slab allocator for small, fixed-size kernel objects.
+//
+// A kmem_cache hands out objects of one size. Objects are carved
+// out of slabs: single kalloc() pages that start with a struct
+// slab header, followed by as many objects as fit. Free objects
+// within a slab are chained through their first word.
+//
+// In front of the slabs, each CPU keeps a magazine: a small stack
+// of free objects it can allocate from and free to with interrupts
+// off and no lock. Only an empty or full magazine takes the cache
+// lock, to move half a magazine's worth of objects at once.
+//
+// Interface:
+// * kmem_cache_create(name, size) at boot, once per object type.
+// * kmem_cache_alloc(c) returns an object, or 0 if out of memory.
+//   The contents are undefined.
+// * kmem_cache_free(c, obj) returns an object to its cache.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "page.h"
+#include "defs.h"
+
+#define NCACHE   8   // maximum number of caches
+#define MAGSIZE 16   // objects per per-CPU magazine
+
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;  // partial list
+  struct slab *prev;
+  void *free;         // chain of free objects
+  int inuse;          // objects handed out
+};
+
+struct magazine {
+  int n;
+  void *obj[MAGSIZE];
+  uint64 nalloc;       // objects handed out on this CPU
+};
+
+struct kmem_cache {
+  char *name;
+  uint size;           // object size, rounded up to 8 bytes
+  uint perslab;        // objects per slab
+  struct spinlock lock;
+  struct slab *partial; // slabs with at least one free object
+  int nslab;           // slabs allocated
+  uint64 nrefill;      // magazine refills from the slabs
+  struct magazine mag[NCPU];
+};
+
+static struct {
+  struct spinlock lock;
+  struct kmem_cache cache[NCACHE];
+  int n;
+} slabs;
+
+void
+slabinit(void)
+{
+  initlock(&slabs.lock, "slabs");
+}
+
+// Create a cache for objects of the given size.
+// Panics if the cache table is full or objects do not
+// fit in a page; caches are only created at boot.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *c;
+
+  size = (size + 7) & ~7;
+  if(size < sizeof(void*) || size > PGSIZE - sizeof(struct slab))
+    panic("kmem_cache_create: size");
+
+  acquire(&slabs.lock);
+  if(slabs.n >= NCACHE)
+    panic("kmem_cache_create: too many caches");
+  c = &slabs.cache[slabs.n++];
+  release(&slabs.lock);
+
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - sizeof(struct slab)) / size;
+  initlock(&c->lock, name);
+  return c;
+}
+
+// Allocate and carve up a new slab for c.
+// Caller holds c->lock.
+static struct slab*
+slab_grow(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *obj;
+  int i;
+
+  if((s = kalloc()) == 0)
+    return 0;
+  pa2page(s)->flags |= PG_SLAB;
+  pa2page(s)->private = (uint64)c;
+  s->cache = c;
+  s->inuse = 0;
+  s->free = 0;
+  obj = (char*)(s + 1);
+  for(i = 0; i < c->perslab; i++, obj += c->size){
+    *(void**)obj = s->free;
+    s->free = obj;
+  }
+  s->prev = 0;
+  s->next = c->partial;
+  if(s->next)
+    s->next->prev = s;
+  c->partial = s;
+  c->nslab++;
+  return s;
+}
+
+static void
+slab_unlink(struct kmem_cache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+  s->next = s->prev = 0;
+}
+
+// Take one object from c's slabs. Caller holds c->lock.
+static void*
+slab_get(struct kmem_cache *c)
+{
+  struct slab *s;
+  void *obj;
+
+  if((s = c->partial) == 0 && (s = slab_grow(c)) == 0)
+    return 0;
+  obj = s->free;
+  s->free = *(void**)obj;
+  s->inuse++;
+  if(s->free == 0)
+    slab_unlink(c, s);  // full slabs sit on no list
+  return obj;
+}
+
+// Return one object to its slab, releasing the slab's
+// page once it holds no objects. Caller holds c->lock.
+static void
+slab_put(struct kmem_cache *c, void *obj)
+{
+  struct slab *s;
+
+  s = (struct slab*)PGROUNDDOWN((uint64)obj);
+  if(s->cache != c)
+    panic("kmem_cache_free: wrong cache");
+  if(s->free == 0){
+    s->prev = 0;
+    s->next = c->partial;
+    if(s->next)
+      s->next->prev = s;
+    c->partial = s;
+  }
+  *(void**)obj = s->free;
+  s->free = obj;
+  if(--s->inuse == 0){
+    slab_unlink(c, s);
+    c->nslab--;
+    pa2page(s)->flags &= ~PG_SLAB;
+    pa2page(s)->private = 0;
+    kfree(s);
+  }
+}
+
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  void *obj;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == 0){
+    acquire(&c->lock);
+    while(m->n < MAGSIZE/2 && (obj = slab_get(c)) != 0)
+      m->obj[m->n++] = obj;
+    c->nrefill++;
+    release(&c->lock);
+  }
+  obj = 0;
+  if(m->n > 0){
+    obj = m->obj[--m->n];
+    m->nalloc++;
+  }
+  pop_off();
+  return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct magazine *m;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == MAGSIZE){
+    acquire(&c->lock);
+    while(m->n > MAGSIZE/2)
+      slab_put(c, m->obj[--m->n]);
+    release(&c->lock);
+  }
+  m->obj[m->n++] = obj;
+  pop_off();
+}
+
+// Print cache usage. For debugging.
+void
+slabdump(void)
+{
+  struct kmem_cache *c;
+  uint64 nalloc;
+  int i;
+
+  for(c = slabs.cache; c < &slabs.cache[slabs.n]; c++){
+    nalloc = 0;
+    for(i = 0; i < NCPU; i++)
+      nalloc += c->mag[i].nalloc;
+    printf("slab %s: size %d slabs %d alloc %d refill %d\n", c->name,
+           c->size, c->nslab, (int)nalloc, (int)c->nrefill);
+  }
+}
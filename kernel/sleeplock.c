@@ -36,7 +36,7 @@ releasesleep(struct sleeplock *lk)
   acquire(&lk->lk);
   lk->locked = 0;
   lk->pid = 0;
-  wakeup(lk);
+  wakeupone(lk);
   release(&lk->lk);
 }
 
@@ -1,13 +1,139 @@
 #include "types.h"
 
+// memset, memmove and memcmp work a 64-bit word at a time, eight
+// words per loop iteration, once the pointers are 8-byte aligned;
+// an unaligned head and the tail go a byte at a time, as does all
+// of a copy whose source and destination are differently aligned.
+//
+// Built with RVV=1, they use the RISC-V vector extension instead;
+// only this file is compiled for it. The kernel does not save
+// vector registers when it switches threads, so each vector loop
+// runs with interrupts off.
+
+#ifdef RVV
+#include "param.h"
+#include "riscv.h"
+#include "defs.h"
+
+// Turn the vector unit on for one call, with interrupts off.
+// usertrapret() turns it off, so that user code can neither
+// read what the kernel left in the vector registers nor use
+// the unit itself.
+static void
+vbegin(void)
+{
+  push_off();
+  w_sstatus(r_sstatus() | SSTATUS_VS_INITIAL);
+}
+
+void*
+memset(void *dst, int c, uint n)
+{
+  char *d = dst;
+  uint64 vl;
+
+  vbegin();
+  while(n > 0){
+    asm volatile("vsetvli %0, %1, e8, m8, ta, ma\n"
+                 "vmv.v.x v0, %2\n"
+                 "vse8.v v0, (%3)"
+                 : "=&r" (vl) : "r" (n), "r" (c), "r" (d)
+                 : "memory", "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7");
+    d += vl;
+    n -= vl;
+  }
+  pop_off();
+  return dst;
+}
+
+int
+memcmp(const void *v1, const void *v2, uint n)
+{
+  const uchar *s1 = v1, *s2 = v2;
+  uint64 vl;
+  long i;
+
+  vbegin();
+  while(n > 0){
+    asm volatile("vsetvli %0, %2, e8, m8, ta, ma\n"
+                 "vle8.v v0, (%3)\n"
+                 "vle8.v v8, (%4)\n"
+                 "vmsne.vv v16, v0, v8\n"
+                 "vfirst.m %1, v16"
+                 : "=&r" (vl), "=&r" (i) : "r" (n), "r" (s1), "r" (s2)
+                 : "memory", "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7",
+                   "v8", "v9", "v10", "v11", "v12", "v13", "v14", "v15", "v16");
+    if(i >= 0){
+      pop_off();
+      return s1[i] - s2[i];
+    }
+    s1 += vl;
+    s2 += vl;
+    n -= vl;
+  }
+  pop_off();
+  return 0;
+}
+
+void*
+memmove(void *dst, const void *src, uint n)
+{
+  const char *s = src;
+  char *d = dst;
+  uint64 vl;
+
+  vbegin();
+  if(s < d && s + n > d){
+    // dst overlaps the end of src: copy the last chunk first.
+    // each chunk is loaded whole before it is stored.
+    while(n > 0){
+      asm volatile("vsetvli %0, %1, e8, m8, ta, ma" : "=r" (vl) : "r" (n));
+      n -= vl;
+      asm volatile("vle8.v v0, (%0)\n"
+                   "vse8.v v0, (%1)"
+                   : : "r" (s + n), "r" (d + n)
+                   : "memory", "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7");
+    }
+  } else {
+    while(n > 0){
+      asm volatile("vsetvli %0, %1, e8, m8, ta, ma\n"
+                   "vle8.v v0, (%2)\n"
+                   "vse8.v v0, (%3)"
+                   : "=&r" (vl) : "r" (n), "r" (s), "r" (d)
+                   : "memory", "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7");
+      s += vl;
+      d += vl;
+      n -= vl;
+    }
+  }
+  pop_off();
+  return dst;
+}
+
+#else
+
 void*
 memset(void *dst, int c, uint n)
 {
   char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uint64 w, *wdst;
+
+  for(; n > 0 && ((uint64)cdst & 7) != 0; n--)
+    *cdst++ = c;
+  w = (uchar)c;
+  w |= w << 8;
+  w |= w << 16;
+  w |= w << 32;
+  wdst = (uint64 *) cdst;
+  for(; n >= 64; n -= 64, wdst += 8){
+    wdst[0] = w; wdst[1] = w; wdst[2] = w; wdst[3] = w;
+    wdst[4] = w; wdst[5] = w; wdst[6] = w; wdst[7] = w;
   }
+  for(; n >= 8; n -= 8)
+    *wdst++ = w;
+  cdst = (char *) wdst;
+  while(n-- > 0)
+    *cdst++ = c;
   return dst;
 }
 
@@ -18,6 +144,15 @@ memcmp(const void *v1, const void *v2, uint n)
 
   s1 = v1;
   s2 = v2;
+  if((((uint64)s1 ^ (uint64)s2) & 7) == 0){
+    for(; n > 0 && ((uint64)s1 & 7) != 0; n--, s1++, s2++){
+      if(*s1 != *s2)
+        return *s1 - *s2;
+    }
+    // skip equal words; the bytes below find where one differs.
+    for(; n >= 8 && *(uint64*)s1 == *(uint64*)s2; n -= 8)
+      s1 += 8, s2 += 8;
+  }
   while(n-- > 0){
     if(*s1 != *s2)
       return *s1 - *s2;
@@ -32,24 +167,62 @@ memmove(void *dst, const void *src, uint n)
 {
   const char *s;
   char *d;
+  const uint64 *ws;
+  uint64 *wd;
+  int words;
 
   if(n == 0)
     return dst;
   
   s = src;
   d = dst;
+  words = (((uint64)s ^ (uint64)d) & 7) == 0;
   if(s < d && s + n > d){
     s += n;
     d += n;
+    if(words){
+      for(; n > 0 && ((uint64)d & 7) != 0; n--)
+        *--d = *--s;
+      // word by word from the top down, so that each word
+      // is read before the copy can overwrite it.
+      ws = (const uint64 *) s;
+      wd = (uint64 *) d;
+      for(; n >= 64; n -= 64){
+        ws -= 8, wd -= 8;
+        wd[7] = ws[7]; wd[6] = ws[6]; wd[5] = ws[5]; wd[4] = ws[4];
+        wd[3] = ws[3]; wd[2] = ws[2]; wd[1] = ws[1]; wd[0] = ws[0];
+      }
+      for(; n >= 8; n -= 8)
+        *--wd = *--ws;
+      s = (const char *) ws;
+      d = (char *) wd;
+    }
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+    if(words){
+      for(; n > 0 && ((uint64)d & 7) != 0; n--)
+        *d++ = *s++;
+      ws = (const uint64 *) s;
+      wd = (uint64 *) d;
+      for(; n >= 64; n -= 64, ws += 8, wd += 8){
+        wd[0] = ws[0]; wd[1] = ws[1]; wd[2] = ws[2]; wd[3] = ws[3];
+        wd[4] = ws[4]; wd[5] = ws[5]; wd[6] = ws[6]; wd[7] = ws[7];
+      }
+      for(; n >= 8; n -= 8)
+        *wd++ = *ws++;
+      s = (const char *) ws;
+      d = (char *) wd;
+    }
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
 
+#endif
+
 // memcpy exists to placate GCC.  Use memmove.
 void*
 memcpy(void *dst, const void *src, uint n)
@@ -0,0 +1,137 @@
+// Time memset, memmove and memcmp against byte-at-a-time
+// versions, at boot, and print bytes copied (or set, or
+// compared) per cycle. Built in by make STRINGBENCH=1; add
+// RVV=1 to time the vector versions instead of the word ones.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define BUFORDER 4                 // kalloc_pages() order: 64KB
+#define TOTAL    (4*1024*1024)     // about this many bytes per measurement
+
+#ifdef RVV
+#define VARIANT "rvv"
+#else
+#define VARIANT "word"
+#endif
+
+static int sizes[] = { 64, 512, 4096, 65536 };
+
+static void*
+bytememset(void *dst, int c, uint n)
+{
+  char *d = dst;
+
+  while(n-- > 0)
+    *d++ = c;
+  return dst;
+}
+
+static void*
+bytememmove(void *dst, const void *src, uint n)
+{
+  const char *s = src;
+  char *d = dst;
+
+  while(n-- > 0)
+    *d++ = *s++;
+  return dst;
+}
+
+static int
+bytememcmp(const void *v1, const void *v2, uint n)
+{
+  const uchar *s1 = v1, *s2 = v2;
+
+  for(; n > 0; n--, s1++, s2++){
+    if(*s1 != *s2)
+      return *s1 - *s2;
+  }
+  return 0;
+}
+
+// print bytes in cycles as bytes per cycle.
+static void
+rate(char *variant, uint64 bytes, uint64 cycles)
+{
+  uint64 r;
+
+  if(cycles == 0)
+    cycles = 1;
+  r = bytes * 100 / cycles;
+  printf(" %s %d.%d%d", variant, (int)(r / 100), (int)(r / 10 % 10), (int)(r % 10));
+}
+
+void
+stringbench(void)
+{
+  char *a, *b;
+  int i, j, n, iters;
+  uint64 t;
+  volatile int sum = 0;
+
+  a = kalloc_pages(BUFORDER);
+  b = kalloc_pages(BUFORDER);
+  if(a == 0 || b == 0)
+    panic("stringbench");
+  memset(a, 0, PGSIZE << BUFORDER);
+  memset(b, 0, PGSIZE << BUFORDER);
+
+  for(i = 0; i < NELEM(sizes); i++){
+    n = sizes[i];
+    iters = TOTAL / n;
+
+    printf("memset %d:", n);
+    t = r_cycle();
+    for(j = 0; j < iters; j++)
+      bytememset(a, j, n);
+    rate("byte", (uint64)iters * n, r_cycle() - t);
+    t = r_cycle();
+    for(j = 0; j < iters; j++)
+      memset(a, j, n);
+    rate(VARIANT, (uint64)iters * n, r_cycle() - t);
+    printf(" bytes/cycle\n");
+
+    printf("memmove %d:", n);
+    t = r_cycle();
+    for(j = 0; j < iters; j++)
+      bytememmove(b, a, n);
+    rate("byte", (uint64)iters * n, r_cycle() - t);
+    t = r_cycle();
+    for(j = 0; j < iters; j++)
+      memmove(b, a, n);
+    rate(VARIANT, (uint64)iters * n, r_cycle() - t);
+    printf(" bytes/cycle\n");
+
+    // source and destination differently aligned
+    printf("memmove %d unaligned:", n);
+    t = r_cycle();
+    for(j = 0; j < iters; j++)
+      bytememmove(b, a + 1, n - 1);
+    rate("byte", (uint64)iters * (n - 1), r_cycle() - t);
+    t = r_cycle();
+    for(j = 0; j < iters; j++)
+      memmove(b, a + 1, n - 1);
+    rate(VARIANT, (uint64)iters * (n - 1), r_cycle() - t);
+    printf(" bytes/cycle\n");
+
+    // equal buffers, so each call compares all n bytes
+    memmove(b, a, n);
+    printf("memcmp %d:", n);
+    t = r_cycle();
+    for(j = 0; j < iters; j++)
+      sum += bytememcmp(a, b, n);
+    rate("byte", (uint64)iters * n, r_cycle() - t);
+    t = r_cycle();
+    for(j = 0; j < iters; j++)
+      sum += memcmp(a, b, n);
+    rate(VARIANT, (uint64)iters * n, r_cycle() - t);
+    printf(" bytes/cycle\n");
+  }
+
+  kfree_pages(a, BUFORDER);
+  kfree_pages(b, BUFORDER);
+}
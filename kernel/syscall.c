@@ -104,6 +104,11 @@ extern uint64 sys_unlink(void);
 extern uint64 sys_wait(void);
 extern uint64 sys_write(void);
 extern uint64 sys_uptime(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_splice(void);
+extern uint64 sys_vmsplice(void);
+extern uint64 sys_nanosleep(void);
+extern uint64 sys_clock_gettime(void);
 
 static uint64 (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -127,6 +132,11 @@ static uint64 (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_spawn]   sys_spawn,
+[SYS_splice]  sys_splice,
+[SYS_vmsplice] sys_vmsplice,
+[SYS_nanosleep] sys_nanosleep,
+[SYS_clock_gettime] sys_clock_gettime,
 };
 
 void
@@ -135,6 +145,10 @@ syscall(void)
   int num;
   struct proc *p = myproc();
 
+  push_off();
+  mycpu()->nsyscall++;
+  pop_off();
+
   num = p->trapframe->a7;
   if(num > 0 && num < NELEM(syscalls) && syscalls[num]) {
     p->trapframe->a0 = syscalls[num]();
@@ -20,3 +20,8 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_spawn  22
+#define SYS_splice 23
+#define SYS_vmsplice 24
+#define SYS_nanosleep 25
+#define SYS_clock_gettime 26
@@ -412,19 +412,27 @@ sys_chdir(void)
   return 0;
 }
 
-uint64
-sys_exec(void)
+// Free the kernel copy of an argv array.
+static void
+freeargv(char *argv[MAXARG])
 {
-  char path[MAXPATH], *argv[MAXARG];
   int i;
-  uint64 uargv, uarg;
 
-  if(argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0){
-    return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+  for(i = 0; i < MAXARG && argv[i] != 0; i++)
+    kfree(argv[i]);
+}
+
+// Copy the user's argv array at uargv into kernel pages.
+// Returns 0, or -1 after freeing whatever was copied.
+static int
+fetchargv(uint64 uargv, char *argv[MAXARG])
+{
+  int i;
+  uint64 uarg;
+
+  memset(argv, 0, MAXARG*sizeof(char*));
   for(i=0;; i++){
-    if(i >= NELEM(argv)){
+    if(i >= MAXARG){
       goto bad;
     }
     if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0){
@@ -440,18 +448,70 @@ sys_exec(void)
     if(fetchstr(uarg, argv[i], PGSIZE) < 0)
       goto bad;
   }
+  return 0;
 
-  int ret = exec(path, argv);
+ bad:
+  freeargv(argv);
+  return -1;
+}
 
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
+uint64
+sys_exec(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  uint64 uargv;
+
+  if(argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0){
+    return -1;
+  }
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
 
+  int ret = exec(path, argv);
+
+  freeargv(argv);
   return ret;
+}
 
- bad:
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
-  return -1;
+// spawn(path, argv, fds): run path in a new child process,
+// like fork() then exec() but without copying the caller.
+// The child's descriptors 0, 1 and 2 are the caller's fds[0],
+// fds[1] and fds[2]; an entry of -1 leaves that descriptor
+// closed, and a null fds passes on the caller's 0, 1 and 2.
+// Returns the child's pid.
+uint64
+sys_spawn(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  uint64 uargv, ufds;
+  struct file *files[3];
+  int fds[3], i;
+
+  if(argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0 ||
+     argaddr(2, &ufds) < 0){
+    return -1;
+  }
+  for(i = 0; i < 3; i++)
+    fds[i] = i;
+  if(ufds && copyin(myproc()->pagetable, (char*)fds, ufds, sizeof(fds)) < 0)
+    return -1;
+  for(i = 0; i < 3; i++){
+    files[i] = 0;
+    if(fds[i] == -1)
+      continue;
+    if(fds[i] < 0 || fds[i] >= NOFILE)
+      return -1;
+    files[i] = myproc()->ofile[fds[i]];
+    if(files[i] == 0 && ufds)
+      return -1;
+  }
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
+
+  int ret = spawn(path, argv, files);
+
+  freeargv(argv);
+  return ret;
 }
 
 uint64
@@ -484,3 +544,28 @@ sys_pipe(void)
   }
   return 0;
 }
+
+uint64
+sys_splice(void)
+{
+  struct file *in, *out;
+  int n;
+
+  if(argfd(0, 0, &in) < 0 || argfd(1, 0, &out) < 0 || argint(2, &n) < 0)
+    return -1;
+  return filesplice(in, out, n);
+}
+
+uint64
+sys_vmsplice(void)
+{
+  struct file *f;
+  uint64 addr;
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || argaddr(1, &addr) < 0 || argint(2, &n) < 0)
+    return -1;
+  if(f->type != FD_PIPE || f->writable == 0 || n < 0)
+    return -1;
+  return pipevmsplice(f->pipe, addr, n);
+}
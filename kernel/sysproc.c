@@ -41,7 +41,7 @@ sys_wait(void)
 uint64
 sys_sbrk(void)
 {
-  int addr;
+  uint64 addr;
   int n;
 
   if(argint(0, &n) < 0)
@@ -67,7 +67,8 @@ sys_sleep(void)
       release(&tickslock);
       return -1;
     }
-    sleep(&ticks, &tickslock);
+    // woken only by its timer, or by kill().
+    sleeptimeout(&ticks, &tickslock, n - (ticks - ticks0));
   }
   release(&tickslock);
   return 0;
@@ -95,3 +96,28 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+#define NSPERTIME (1000000000/TIMEFREQ)
+
+// Sleep for at least the given number of nanoseconds.
+uint64
+sys_nanosleep(void)
+{
+  uint64 ns;
+
+  if(argaddr(0, &ns) < 0)
+    return -1;
+  return sleepuntil(r_time() + (ns + NSPERTIME - 1) / NSPERTIME);
+}
+
+// Store the nanoseconds since boot at the given address.
+uint64
+sys_clock_gettime(void)
+{
+  uint64 addr, ns;
+
+  if(argaddr(0, &addr) < 0)
+    return -1;
+  ns = r_time() * NSPERTIME;
+  return copyout(myproc()->pagetable, addr, (char*)&ns, sizeof(ns));
+}
@@ -0,0 +1,131 @@
+// Timers, kept on a hashed timer wheel.
+//
+// A pending timer sits in slot expires % NWHEEL of the wheel.
+// Each clock tick looks at one slot and runs the timers in it
+// that are due; timers further than NWHEEL ticks out stay in
+// their slot for more turns of the wheel. Adding and deleting
+// a timer take constant time, and a tick costs only as much
+// as the timers that share its slot.
+//
+// Interface:
+// * timer_init(t, fn, arg) before first use of t.
+// * timer_add(t, n) runs fn(arg) from clockintr() n ticks from
+//   now, with no locks held. t must not be pending.
+//   hrtimer.c has the same interface for finer times.
+// * timer_del(t) cancels t; returns 1 if it was pending, 0 if it
+//   has run (or is running on another cpu). Once timer_del()
+//   returns, the timer code no longer looks at t.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "timer.h"
+#include "defs.h"
+
+#define NWHEEL 64  // slots, one per tick
+
+static struct {
+  struct spinlock lock;
+  uint64 now;                // ticks seen by timertick()
+  int n;                     // pending timers
+  struct timer *slot[NWHEEL];
+} wheel;
+
+void
+timerwheelinit(void)
+{
+  initlock(&wheel.lock, "timer");
+}
+
+void
+timer_init(struct timer *t, void (*fn)(void*), void *arg)
+{
+  t->fn = fn;
+  t->arg = arg;
+  t->next = 0;
+  t->pprev = 0;
+  t->cpu = 0;
+}
+
+// Caller holds wheel.lock.
+static void
+unlink(struct timer *t)
+{
+  wheel.n--;
+  if(t->next)
+    t->next->pprev = t->pprev;
+  *t->pprev = t->next;
+  t->next = 0;
+  t->pprev = 0;
+}
+
+void
+timer_add(struct timer *t, uint64 n)
+{
+  struct timer **s;
+
+  if(n == 0)
+    n = 1;
+  acquire(&wheel.lock);
+  if(t->pprev)
+    panic("timer_add: pending");
+  t->expires = wheel.now + n;
+  s = &wheel.slot[t->expires % NWHEEL];
+  t->next = *s;
+  if(t->next)
+    t->next->pprev = &t->next;
+  t->pprev = s;
+  *s = t;
+  wheel.n++;
+  release(&wheel.lock);
+}
+
+int
+timer_del(struct timer *t)
+{
+  int pending;
+
+  acquire(&wheel.lock);
+  pending = t->pprev != 0;
+  if(pending)
+    unlink(t);
+  release(&wheel.lock);
+  return pending;
+}
+
+// Are any timers pending? Without the lock, for an idle
+// cpu deciding whether it needs clock ticks; see hrtimer.c.
+int
+timer_npending(void)
+{
+  return wheel.n;
+}
+
+// Run the timers that are due. Called by clockintr().
+void
+timertick(void)
+{
+  struct timer *t;
+  void (*fn)(void*);
+  void *arg;
+  uint64 now;
+
+  acquire(&wheel.lock);
+  now = ++wheel.now;
+  for(;;){
+    for(t = wheel.slot[now % NWHEEL]; t; t = t->next)
+      if(t->expires <= now)
+        break;
+    if(t == 0)
+      break;
+    // t may be freed as soon as it is off the wheel.
+    unlink(t);
+    fn = t->fn;
+    arg = t->arg;
+    release(&wheel.lock);
+    fn(arg);
+    acquire(&wheel.lock);
+  }
+  release(&wheel.lock);
+}
@@ -0,0 +1,11 @@
+// A callback to run at some time in the future: a number of
+// clock ticks from now (timer_add()), or at a value of the time
+// CSR on the cpu that adds it (hrtimer_add()).
+struct timer {
+  uint64 expires;            // tick or time at which to run
+  void (*fn)(void*);         // runs from a timer interrupt; must not sleep
+  void *arg;
+  struct timer *next;        // on its wheel slot or cpu queue, if pending
+  struct timer **pprev;      // 0 if not pending
+  int cpu;                   // hrtimer: cpu whose queue it is on
+};
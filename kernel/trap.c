@@ -13,6 +13,7 @@ extern char trampoline[], uservec[], userret[];
 
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
+extern char ucopy_start[], ucopy_end[], ucopy_fixup[]; // usercopy.S
 void store_pgfault_handler();
 
 extern int devintr();
@@ -91,7 +92,11 @@ store_pgfault_handler()
 {
   uint64 va = r_stval();
   struct proc *p = myproc();
-  switch (cow_pgfault(p->pagetable, va))
+  // first touch of a lazily grown heap page, else a COW page
+  int r = lazy_fault(p->pagetable, va, r_scause() == STORE_PGFAULT);
+  if (r == -2)
+    r = cow_pgfault(p->pagetable, va);
+  switch (r)
   {
   // success
   case 0:
@@ -100,7 +105,7 @@ store_pgfault_handler()
   
   // OOM
   case -1:
-    printf("Out of memory when copying a COW page");
+    printf("Out of memory in page fault pid=%d va=%p\n", p->pid, va);
     p->killed = 1;
     break;
 
@@ -127,9 +132,12 @@ usertrapret(void)
   // send syscalls, interrupts, and exceptions to trampoline.S
   w_stvec(TRAMPOLINE + (uservec - trampoline));
 
+  // the process's kernel and user page tables share its ASID.
+  uint64 asid = asid_activate(p);
+
   // set up trapframe values that uservec will need when
   // the process next re-enters the kernel.
-  p->trapframe->kernel_satp = r_satp();         // kernel page table
+  p->trapframe->kernel_satp = MAKE_SATP(p->kpagetable, asid); // kernel page table
   p->trapframe->kernel_sp = p->kstack + PGSIZE; // process's kernel stack
   p->trapframe->kernel_trap = (uint64)usertrap;
   p->trapframe->kernel_hartid = r_tp();         // hartid for cpuid()
@@ -141,13 +149,15 @@ usertrapret(void)
   unsigned long x = r_sstatus();
   x &= ~SSTATUS_SPP; // clear SPP to 0 for user mode
   x |= SSTATUS_SPIE; // enable interrupts in user mode
+  x &= ~SSTATUS_SUM; // see usercopy.S
+  x &= ~SSTATUS_VS;  // no vector unit, nor string.c's leftovers in it
   w_sstatus(x);
 
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
   // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = MAKE_SATP(p->pagetable, asid);
 
   // jump to trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
@@ -156,6 +166,29 @@ usertrapret(void)
   ((void (*)(uint64,uint64))fn)(TRAPFRAME, satp);
 }
 
+// A page fault in copyuser() or copyuserstr() (usercopy.S) on a
+// user address: fill in a lazily grown or COW page and retry, or
+// else resume at ucopy_fixup, which makes the copy return -1.
+// Returns 0 if the trap was not such a fault.
+static int
+ucopyfault(uint64 scause, uint64 *sepc)
+{
+  struct proc *p = myproc();
+  uint64 va = r_stval();
+  int r;
+
+  if(*sepc < (uint64)ucopy_start || *sepc >= (uint64)ucopy_end)
+    return 0;
+  if((scause != LOAD_PGFAULT && scause != STORE_PGFAULT) || va >= USERTOP)
+    return 0;
+  r = lazy_fault(p->pagetable, va, scause == STORE_PGFAULT);
+  if(r == -2 && scause == STORE_PGFAULT)
+    r = cow_pgfault(p->pagetable, va);
+  if(r != 0)
+    *sepc = (uint64)ucopy_fixup;
+  return 1;
+}
+
 // interrupts and exceptions from kernel code go here via kernelvec,
 // on whatever the current kernel stack is.
 void 
@@ -171,7 +204,7 @@ kerneltrap()
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
-  if((which_dev = devintr()) == 0){
+  if((which_dev = devintr()) == 0 && !ucopyfault(scause, &sepc)){
     printf("scause %p\n", scause);
     printf("sepc=%p stval=%p\n", r_sepc(), r_stval());
     panic("kerneltrap");
@@ -187,13 +220,37 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
+// Time of the next clock tick; tickslock.
+uint64 nexttick;
+
+// Advance ticks to time now, running the timer wheel once
+// per tick. Called by hrtimerintr() on every cpu, so that
+// ticks keep counting while some cpus are idle.
 void
-clockintr()
+clockintr(uint64 now)
 {
+  int n;
+
+  n = 0;
   acquire(&tickslock);
-  ticks++;
-  wakeup(&ticks);
+  if(nexttick == 0)
+    nexttick = now + TICK;
+  while(nexttick <= now){
+    ticks++;
+    nexttick += TICK;
+    n++;
+  }
   release(&tickslock);
+  while(n-- > 0)
+    timertick();
+}
+
+// The time of the next clock tick, without tickslock:
+// a stale value is early, not late.
+uint64
+clocknext(void)
+{
+  return nexttick;
 }
 
 // check if it's an external interrupt or software interrupt,
@@ -229,18 +286,16 @@ devintr()
 
     return 1;
   } else if(scause == 0x8000000000000001L){
-    // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
-
-    if(cpuid() == 0){
-      clockintr();
-    }
+    // software interrupt from a machine-mode timer interrupt
+    // or IPI, forwarded by timervec in kernelvec.S.
     
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
     w_sip(r_sip() & ~2);
 
-    return 2;
+    // a timer interrupt only if the scheduler slice is over;
+    // else it was for an hrtimer, or an IPI.
+    return hrtimerintr() ? 2 : 1;
   } else {
     return 0;
   }
@@ -22,10 +22,10 @@
 
 static struct disk {
   // the virtio driver and device mostly communicate through a set of
-  // structures in RAM. pages[] allocates that memory. pages[] is a
-  // global (instead of calls to kalloc()) because it must consist of
-  // two contiguous pages of page-aligned physical memory.
-  char pages[2*PGSIZE];
+  // structures in RAM. pages points to that memory, which must
+  // consist of two contiguous pages of page-aligned physical
+  // memory, and so comes from kalloc_pages(1).
+  char *pages;
 
   // pages[] is divided into three regions (descriptors, avail, and
   // used), as explained in Section 2.6 of the virtio specification
@@ -71,7 +71,7 @@ static struct disk {
   
   struct spinlock vdisk_lock;
   
-} __attribute__ ((aligned (PGSIZE))) disk;
+} disk;
 
 void
 virtio_disk_init(void)
@@ -122,7 +122,9 @@ virtio_disk_init(void)
   if(max < NUM)
     panic("virtio disk max queue too short");
   *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-  memset(disk.pages, 0, sizeof(disk.pages));
+  if((disk.pages = kalloc_pages(1)) == 0)
+    panic("virtio disk kalloc");
+  memset(disk.pages, 0, 2*PGSIZE);
   *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)disk.pages) >> PGSHIFT;
 
   // desc = pages -- num * virtq_desc
@@ -3,6 +3,8 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -11,21 +13,40 @@
  */
 pagetable_t kernel_pagetable;
 
+// a page of zeros, mapped read-only and COW wherever a lazily
+// grown page is read before it is written. It holds one extra
+// reference of its own, so it is always copied, never freed.
+static char *zeropage;
+
+#define MEGAORDER 9   // kalloc_pages() order of a megapage
+
+// COW policy statistics, for procdump. A hot page is one made
+// writable before anyone wrote it: copied for the child by fork,
+// or resolved as a neighbour of a COW fault. Once unmapped or
+// shared again, it counts as a fault avoided if it was written.
+static struct {
+  uint64 eager;    // pages fork copied up front
+  uint64 around;   // pages fault-around resolved
+  uint64 avoided;  // hot pages that were written
+  uint64 unused;   // hot pages that never were
+} cowstat;
+
+static int splitmega(pte_t *);
+static int unsharept(pagetable_t, pte_t *);
+static int mapmega(pagetable_t, uint64, uint64, int);
+static void hotdone(pte_t);
+
 extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
-extern unsigned char rc[];
-extern struct spinlock rc_lock;
-
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
 {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t) kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t) kalloc_zeroed();
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -36,6 +57,9 @@ kvmmake(void)
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
+  // CLINT, for hrtimer.c to set each hart's next timer interrupt
+  kvmmap(kpgtbl, KCLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // map kernel text executable and read-only.
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
@@ -57,17 +81,155 @@ void
 kvminit(void)
 {
   kernel_pagetable = kvmmake();
+  if((zeropage = kalloc_zeroed()) == 0)
+    panic("kvminit: zeropage");
+  cow_refinc((uint64)zeropage);
 }
 
+// ASIDs tag TLB entries with the address space they belong to,
+// so that switching satp between the kernel and processes need
+// not flush the TLB. kernel_pagetable uses ASID 0; a process's
+// kernel page table uses the process's ASID, since it maps user
+// memory just as the user page table does. The two tables differ
+// only in the kernel's own mappings, which kvmmap() makes global,
+// so a TLB entry tagged with the process's ASID is right for
+// both. (TRAPFRAME, mapped only in the user table, is never used
+// by the kernel, which reaches the trapframe at p->trapframe.)
+//
+// ASIDs are handed out in generations: within one, each number
+// goes to at most one address space, so entries left behind by
+// an exited process are never hit. When the numbers run out a
+// new generation starts, and each hart flushes its whole TLB
+// before it next runs user code.
+struct {
+  struct spinlock lock;
+  uint64 gen;         // current generation, above SATP_ASID_MASK
+  uint64 next;        // next unused ASID in this generation
+  uint64 nasid;       // ASIDs the hardware implements
+  uint64 nrollover;   // generations started
+} asids;
+
 // Switch h/w page table register to the kernel's page table,
 // and enable paging.
 void
 kvminithart()
 {
-  w_satp(MAKE_SATP(kernel_pagetable));
+  if(cpuid() == 0){
+    // find out how many ASID bits the hardware implements.
+    w_satp(MAKE_SATP(kernel_pagetable, SATP_ASID_MASK));
+    asids.nasid = ((r_satp() >> SATP_ASID_SHIFT) & SATP_ASID_MASK) + 1;
+    initlock(&asids.lock, "asid");
+    asids.gen = SATP_ASID_MASK + 1;
+    asids.next = 1;
+  }
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
   sfence_vma();
 }
 
+// Return the ASID p should run with on this hart, assigning a
+// new one if p's is from an old generation, and flushing
+// whatever this hart's TLB may hold stale. Returns 0, which
+// makes the trampoline flush, if the hardware has no ASIDs.
+// Called with interrupts off.
+uint64
+asid_activate(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  uint64 gen;
+
+  if(asids.nasid <= 1)
+    return 0;
+
+  gen = __atomic_load_n(&asids.gen, __ATOMIC_ACQUIRE);
+  if((p->asid & ~SATP_ASID_MASK) != gen){
+    acquire(&asids.lock);
+    if(asids.next >= asids.nasid){
+      asids.gen += SATP_ASID_MASK + 1;
+      asids.next = 1;
+      asids.nrollover++;
+    }
+    p->asid = asids.gen | asids.next++;
+    gen = asids.gen;
+    release(&asids.lock);
+  }
+
+  if(c->asidgen != gen){
+    // entries from the last generation may carry ASIDs
+    // that now belong to someone else.
+    sfence_vma();
+    c->asidgen = gen;
+  } else if(p->lastcpu != cpuid()){
+    // entries from p's earlier run here may predate changes
+    // made to its page table on another hart.
+    sfence_vma_asid(p->asid & SATP_ASID_MASK);
+  }
+  p->lastcpu = cpuid();
+  return p->asid & SATP_ASID_MASK;
+}
+
+// Switch this hart to p's kernel page table, or to
+// kernel_pagetable if p is 0. Called with interrupts off.
+void
+kvmactivate(struct proc *p)
+{
+  if(p)
+    w_satp(MAKE_SATP(p->kpagetable, asid_activate(p)));
+  else
+    w_satp(MAKE_SATP(kernel_pagetable, 0));
+  if(asids.nasid <= 1)
+    sfence_vma();
+}
+
+// Create the kernel page table for a process whose user page
+// table is upt: kernel_pagetable's mappings, except that the
+// first 1GB is upt's, so that the kernel reaches user memory
+// directly. See uvmcreate() and copyout().
+pagetable_t
+kvmcreate(pagetable_t upt)
+{
+  pagetable_t kpt;
+
+  if((kpt = (pagetable_t)kalloc()) == 0)
+    return 0;
+  memmove(kpt, kernel_pagetable, PGSIZE);
+  kpt[0] = upt[0];
+  return kpt;
+}
+
+// Point p's kernel page table at p's new user page table.
+void
+kvmsetuser(struct proc *p)
+{
+  p->kpagetable[0] = p->pagetable[0];
+  if(p == myproc()){
+    push_off();
+    kvmactivate(p);
+    pop_off();
+  }
+}
+
+// After changing the PTE for va in pagetable, drop this hart's
+// cached translation. Only the current process can be live in
+// this TLB; other harts are taken care of when p moves there.
+static void
+tlbflush_page(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+
+  if(p && p->pagetable == pagetable)
+    sfence_vma_page(va, p->asid & SATP_ASID_MASK);
+}
+
+// Like tlbflush_page(), for every page of pagetable.
+static void
+tlbflush_all(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  if(p && p->pagetable == pagetable)
+    sfence_vma_asid(p->asid & SATP_ASID_MASK);
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -80,29 +242,105 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A valid level-1 PTE may instead be a leaf mapping a 2MB
+// megapage. With alloc!=0 walk() splits such a megapage into
+// 4096-byte pages; without, it returns 0, and callers that
+// need to see megapages use walkleaf().
+//
+// With alloc!=0 the returned PTE may be written: a leaf
+// page-table page shared after fork is copied first.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
+  pagetable_t root = pagetable;
+
   if(va >= MAXVA)
     panic("walk");
 
   for(int level = 2; level > 0; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
+    if((*pte & PTE_V) && PTE_LEAF(*pte)) {
+      if(level != 1)
+        panic("walk: gigapage");
+      if(!alloc || splitmega(pte) != 0)
+        return 0;
+    }
+    if(alloc && (*pte & PTE_V) && (*pte & PTE_COW)) {
+      if(unsharept(root, pte) != 0)
+        return 0;
+    }
     if(*pte & PTE_V) {
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
   return &pagetable[PX(0, va)];
 }
 
+// Return the PTE that maps va without allocating: the level-0
+// PTE, or a level-1 megapage leaf, with *level set to 0 or 1.
+// When va has no level-0 page-table page, returns the invalid
+// level-1 PTE; when it has no level-1 page either, returns 0.
+static pte_t *
+walkleaf(pagetable_t pagetable, uint64 va, int *level)
+{
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    panic("walkleaf");
+
+  pte = &pagetable[PX(2, va)];
+  if((*pte & PTE_V) == 0)
+    return 0;
+  pagetable = (pagetable_t)PTE2PA(*pte);
+  pte = &pagetable[PX(1, va)];
+  *level = 1;
+  if((*pte & PTE_V) == 0 || PTE_LEAF(*pte))
+    return pte;
+  pagetable = (pagetable_t)PTE2PA(*pte);
+  *level = 0;
+  return &pagetable[PX(0, va)];
+}
+
+// Physical address of the page that the leaf pte, found at
+// level by walkleaf(), maps for the page-aligned va.
+static uint64
+leafpa(pte_t pte, int level, uint64 va)
+{
+  if(level == 1)
+    return PTE2PA(pte) + (PGROUNDDOWN(va) & (MEGAPGSIZE-1));
+  return PTE2PA(pte);
+}
+
+// Replace the megapage leaf *pte with a level-0 page-table
+// page of 512 leaves with the same flags. Each frame keeps the
+// reference it already had. Returns 0, or -1 if out of memory.
+static int
+splitmega(pte_t *pte)
+{
+  pagetable_t pt;
+  uint64 pa, flags;
+  int i;
+
+  if((pt = (pagetable_t)kalloc()) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = PTE_FLAGS(*pte);
+  for(i = 0; i < 512; i++)
+    pt[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(pt) | PTE_V;
+  return 0;
+}
+
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
+// Fills in pages of the current process that sbrk
+// grew lazily and that have not been touched yet.
 uint64
 walkaddr(pagetable_t pagetable, uint64 va)
 {
@@ -112,25 +350,47 @@ walkaddr(pagetable_t pagetable, uint64 va)
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
-  if(pte == 0)
-    return 0;
-  if((*pte & PTE_V) == 0)
-    return 0;
+  int level;
+  pte = walkleaf(pagetable, va, &level);
+  if(pte == 0 || (*pte & PTE_V) == 0){
+    if(lazy_fault(pagetable, va, 0) != 0)
+      return 0;
+    pte = walkleaf(pagetable, va, &level);
+  }
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  pa = leafpa(*pte, level, va);
   return pa;
 }
 
 // add a mapping to the kernel page table.
 // only used when booting.
 // does not flush TLB or enable paging.
+// uses megapages wherever va and pa are both 2MB-aligned.
+// the mappings are global: every kernel page table has them,
+// so their TLB entries need no ASID; see asid_activate().
 void
 kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kpgtbl, va, sz, pa, perm) != 0)
-    panic("kvmmap");
+  uint64 n;
+
+  perm |= PTE_G;
+  while(sz > 0){
+    if((va % MEGAPGSIZE) == 0 && (pa % MEGAPGSIZE) == 0 && sz >= MEGAPGSIZE){
+      n = MEGAPGSIZE;
+      if(mapmega(kpgtbl, va, pa, perm) != 0)
+        panic("kvmmap");
+    } else {
+      n = MEGAPGSIZE - (va % MEGAPGSIZE);  // up to the next boundary
+      if(n > sz)
+        n = sz;
+      if(mappages(kpgtbl, va, n, pa, perm) != 0)
+        panic("kvmmap");
+    }
+    va += n;
+    pa += n;
+    sz -= n;
+  }
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
@@ -154,9 +414,7 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
     if(*pte & PTE_V)
       panic("mappages: remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
-    acquire(&rc_lock);
-    (*cow_refcount(pa))++;
-    release(&rc_lock);
+    cow_refinc(pa);
     if(a == last)
       break;
     a += PGSIZE;
@@ -165,47 +423,246 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
+// Return the level-1 PTE for va, allocating the level-1
+// page-table page if needed. Returns 0 if out of memory.
+static pte_t *
+walkpmd_alloc(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+
+  pte = &pagetable[PX(2, va)];
+  if((*pte & PTE_V) == 0){
+    if((pagetable = (pagetable_t)kalloc_zeroed()) == 0)
+      return 0;
+    *pte = PA2PTE(pagetable) | PTE_V;
+  }
+  pagetable = (pagetable_t)PTE2PA(*pte);
+  return &pagetable[PX(1, va)];
+}
+
+// Map the 2MB megapage at va to pa with a single level-1 leaf,
+// taking a reference on each of its frames. va and pa must be
+// megapage-aligned. Returns 0 on success, -1 if a needed
+// page-table page couldn't be allocated.
+static int
+mapmega(pagetable_t pagetable, uint64 va, uint64 pa, int perm)
+{
+  pte_t *pte;
+  uint64 i;
+
+  if((va % MEGAPGSIZE) != 0 || (pa % MEGAPGSIZE) != 0)
+    panic("mapmega: not aligned");
+  if((pte = walkpmd_alloc(pagetable, va)) == 0)
+    return -1;
+  if(*pte & PTE_V)
+    panic("mapmega: remap");
+  *pte = PA2PTE(pa) | perm | PTE_V;
+  for(i = 0; i < MEGAPGSIZE; i += PGSIZE)
+    cow_refinc(pa + i);
+  return 0;
+}
+
+// Leaf page-table pages are shared between a parent and its
+// children by fork. The level-1 PTEs that point to a shared
+// page carry PTE_COW, its refcount counts them, and all the
+// leaves in it are read-only, so that neither side can write
+// through it. The frames it maps hold one reference for the
+// page as a whole. A process that needs to change a PTE in it
+// first takes a private copy (walk() with alloc!=0 does).
+// Page-table pages that are not shared have refcount 0.
+
+// Drop a reference to the shared leaf page-table page pt. The
+// last one releases the frames it maps and frees it.
+static void
+putpt(pagetable_t pt)
+{
+  uint64 pa;
+  int i;
+
+  if(cow_refdec((uint64)pt) != 0)
+    return;
+  for(i = 0; i < 512; i++){
+    if(pt[i] & PTE_V){
+      pa = PTE2PA(pt[i]);
+      if(cow_refdec(pa) == 0)
+        kfree((void*)pa);
+    }
+    pt[i] = 0;
+  }
+  kfree((void*)pt);
+}
+
+// Make the shared leaf page-table page that the level-1 PTE
+// *pmd of pagetable points to private to pagetable, copying it
+// unless no one else holds it any more.
+// Returns 0, or -1 if out of memory.
+static int
+unsharept(pagetable_t pagetable, pte_t *pmd)
+{
+  pagetable_t old, pt;
+  int i;
+
+  old = (pagetable_t)PTE2PA(*pmd);
+  if(cow_refcount((uint64)old) == 1){
+    cow_refdec((uint64)old);
+    *pmd &= ~PTE_COW;
+    return 0;
+  }
+  if((pt = (pagetable_t)kalloc()) == 0)
+    return -1;
+  for(i = 0; i < 512; i++){
+    pt[i] = old[i];
+    if(pt[i] & PTE_V)
+      cow_refinc(PTE2PA(pt[i]));
+  }
+  *pmd = PA2PTE(pt) | PTE_V;
+  // the hardware may cache the old level-1 PTE.
+  tlbflush_all(pagetable);
+  putpt(old);
+  return 0;
+}
+
+// Does every valid PTE in leaf page-table page pt, which maps
+// the 2MB region holding va, lie within [va, end)?
+static int
+ptcovered(pagetable_t pt, uint64 va, uint64 end)
+{
+  uint64 base, a;
+  int i;
+
+  base = MEGAPGROUNDDOWN(va);
+  for(i = 0; i < 512; i++){
+    a = base + (uint64)i*PGSIZE;
+    if((pt[i] & PTE_V) && (a < va || a >= end))
+      return 0;
+  }
+  return 1;
+}
+
+// Range walking: return the level-1 PTE covering va, so that
+// the caller can handle all the level-0 entries below it after
+// a single descent from the root. Returns 0 if va's whole
+// level-2 subtree is empty. Either way, *next is set to the
+// first address past what the result covers, but at most end.
+static pte_t *
+walkpmd(pagetable_t pagetable, uint64 va, uint64 end, uint64 *next)
+{
+  pte_t *pte;
+  uint64 n;
+
+  if(va >= MAXVA)
+    panic("walkpmd");
+
+  pte = &pagetable[PX(2, va)];
+  if((*pte & PTE_V) == 0){
+    n = (va | ((1L << PXSHIFT(2)) - 1)) + 1;
+    *next = n < end ? n : end;
+    return 0;
+  }
+  n = MEGAPGROUNDDOWN(va) + MEGAPGSIZE;
+  *next = n < end ? n : end;
+  pagetable = (pagetable_t)PTE2PA(*pte);
+  return &pagetable[PX(1, va)];
+}
+
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages a lazy sbrk never filled in are skipped.
+// A megapage that is only partly in the range is split first.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
-  pte_t *pte;
+  uint64 a, end, next, i, pa;
+  pte_t *pmd, *pte;
+  pagetable_t pt;
+  int flushall = 0;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
-    if(PTE_FLAGS(*pte) == PTE_V)
-      panic("uvmunmap: not a leaf");
-    
-    uint64 pa = PTE2PA(*pte);
-    acquire(&rc_lock);
-    (*cow_refcount(pa))--;
-    release(&rc_lock);
-    if (do_free && *cow_refcount(pa) == 0) {
-      kfree((void*)pa);
+  end = va + npages*PGSIZE;
+  for(a = va; a < end; a = next){
+    if((pmd = walkpmd(pagetable, a, end, &next)) == 0 || (*pmd & PTE_V) == 0)
+      continue;
+
+    if(!PTE_LEAF(*pmd) && (*pmd & PTE_COW)){
+      // a leaf page-table page shared with other processes:
+      // let go of it whole, unless some of what it maps stays.
+      pt = (pagetable_t)PTE2PA(*pmd);
+      if(do_free && ptcovered(pt, a, next)){
+        *pmd = 0;
+        putpt(pt);
+        flushall = 1;
+        continue;
+      }
+      if(unsharept(pagetable, pmd) != 0)
+        panic("uvmunmap: unshare");
+    }
+
+    if(PTE_LEAF(*pmd)){
+      if((a % MEGAPGSIZE) != 0 || next - a < MEGAPGSIZE){
+        if(splitmega(pmd) != 0)
+          panic("uvmunmap: split");
+      } else {
+        pa = PTE2PA(*pmd);
+        for(i = 0; i < MEGAPGSIZE; i += PGSIZE){
+          if(cow_refdec(pa + i) == 0 && do_free)
+            kfree((void*)(pa + i));
+        }
+        *pmd = 0;
+        continue;
+      }
+    }
+
+    pt = (pagetable_t)PTE2PA(*pmd);
+    for(; a < next; a += PGSIZE){
+      pte = &pt[PX(0, a)];
+      if((*pte & PTE_V) == 0){
+        *pte = 0;  // a guard page, or never filled in
+        continue;
+      }
+      if(!PTE_LEAF(*pte))
+        panic("uvmunmap: not a leaf");
+      hotdone(*pte);
+      pa = PTE2PA(*pte);
+      if (cow_refdec(pa) == 0 && do_free) {
+        kfree((void*)pa);
+      }
+      *pte = 0;
     }
-    *pte = 0;
+  }
+
+  if(npages <= 16 && !flushall){
+    for(a = va; a < end; a += PGSIZE)
+      tlbflush_page(pagetable, a);
+  } else {
+    tlbflush_all(pagetable);
   }
 }
 
-// create an empty user page table.
+// create an empty user page table. Its first 1GB, which the
+// process's kernel page table shares, holds the kernel's device
+// mappings, marked global; see kvmcreate().
 // returns 0 if out of memory.
 pagetable_t
 uvmcreate()
 {
-  pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable_t pagetable, pmd, kpmd;
+  int i;
+
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
+  if((pmd = (pagetable_t) kalloc_zeroed()) == 0){
+    kfree(pagetable);
+    return 0;
+  }
+  kpmd = (pagetable_t)PTE2PA(kernel_pagetable[0]);
+  for(i = 0; i < 512; i++){
+    if(kpmd[i] & PTE_V)
+      pmd[i] = kpmd[i] | PTE_G;
+  }
+  pagetable[0] = PA2PTE(pmd) | PTE_V;
   return pagetable;
 }
 
@@ -219,8 +676,7 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -238,12 +694,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -272,17 +727,23 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 }
 
 // Recursively free page-table pages.
-// All leaf mappings must already have been removed.
+// All leaf mappings, megapages included, must already
+// have been removed.
 void
 freewalk(pagetable_t pagetable)
 {
   // there are 2^9 = 512 PTEs in a page table.
   for(int i = 0; i < 512; i++){
     pte_t pte = pagetable[i];
-    if((pte & PTE_V) && (pte & (PTE_R|PTE_W|PTE_X)) == 0){
+    if(pte & PTE_G){
+      pagetable[i] = 0;  // the kernel's; see uvmcreate()
+    } else if((pte & PTE_V) && (pte & (PTE_R|PTE_W|PTE_X)) == 0){
       // this PTE points to a lower-level page table.
       uint64 child = PTE2PA(pte);
-      freewalk((pagetable_t)child);
+      if(pte & PTE_COW)
+        putpt((pagetable_t)child);  // shared after fork
+      else
+        freewalk((pagetable_t)child);
       pagetable[i] = 0;
     } else if(pte & PTE_V){
       panic("freewalk: leaf");
@@ -301,6 +762,60 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
+// Account for a hot PTE that is being unmapped or shared again.
+static void
+hotdone(pte_t pte)
+{
+  if((pte & PTE_HOT) == 0)
+    return;
+  if(pte & PTE_D)
+    __sync_fetch_and_add(&cowstat.avoided, 1);
+  else
+    __sync_fetch_and_add(&cowstat.unused, 1);
+}
+
+// Is the parent's page at va hot: written since the last fork
+// (the hardware set PTE_D) or the one its stack pointer is in?
+static int
+hotpage(pte_t pte, uint64 va, uint64 sp)
+{
+  if((pte & (PTE_V|PTE_W|PTE_U)) != (PTE_V|PTE_W|PTE_U))
+    return 0;
+  return (pte & PTE_D) || va == sp;
+}
+
+// Does leaf page-table page pt map a hot page in [va, end)?
+static int
+ishot(pagetable_t pt, uint64 va, uint64 end, uint64 sp)
+{
+  for(; va < end; va += PGSIZE){
+    if(hotpage(pt[PX(0, va)], va, sp))
+      return 1;
+  }
+  return 0;
+}
+
+// Give the child its own copy of the parent's hot page now,
+// rather than sharing it and taking a COW fault on the next
+// write by either process. Returns -1 if out of memory.
+static int
+eagercopy(pte_t *pte, pte_t *cpte)
+{
+  char *mem;
+  uint64 flags;
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)PTE2PA(*pte), PGSIZE);
+  cow_refinc((uint64)mem);
+  hotdone(*pte);
+  flags = (PTE_FLAGS(*pte) & ~(PTE_D|PTE_A)) | PTE_HOT;
+  *pte = PA2PTE(PTE2PA(*pte)) | flags;
+  *cpte = PA2PTE(mem) | flags;
+  __sync_fetch_and_add(&cowstat.eager, 1);
+  return 0;
+}
+
 // Given a parent process's page table, copy
 // its memory into a child's page table.
 // Copies both the page table and the
@@ -310,36 +825,143 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-  pte_t *pte;
-  uint64 i;
+  pte_t *pmd, *pte, *cpte;
+  pagetable_t pt, cpt;
+  uint64 a, next, flags, sp;
+  int i, budget;
+  struct proc *p = myproc();
+
+  sp = -1;
+  if(p != 0 && p->pagetable == old)
+    sp = PGROUNDDOWN(p->trapframe->sp);
+  budget = COWEAGER;
+  for(a = 0; a < sz; a = next){
+    if((pmd = walkpmd(old, a, sz, &next)) == 0 || (*pmd & PTE_V) == 0)
+      continue;
+    if(PTE_LEAF(*pmd)){
+      // share the whole megapage; a write fault splits it.
+      flags = (PTE_FLAGS(*pmd) & ~(PTE_W|PTE_D|PTE_A)) | PTE_COW;
+      if(mapmega(new, MEGAPGROUNDDOWN(a), PTE2PA(*pmd), flags & ~PTE_V) != 0)
+        goto err;
+      *pmd = PA2PTE(PTE2PA(*pmd)) | flags;
+      continue;
+    }
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
-    if (cow_map(pte, new, i) != 0) {
-      goto err;
+    pt = (pagetable_t)PTE2PA(*pmd);
+    if(MEGAPGROUNDDOWN(a) != MEGAPGROUNDDOWN(TRAPFRAME) &&
+       (budget == 0 || (*pmd & PTE_COW) || !ishot(pt, a, next, sp))){
+      // share the whole leaf page-table page with the child.
+      if((*pmd & PTE_COW) == 0){
+        for(i = 0; i < 512; i++){
+          if(pt[i] & PTE_V){
+            hotdone(pt[i]);
+            pt[i] = (pt[i] & ~(PTE_W|PTE_D|PTE_A|PTE_HOT)) |
+                    PTE_COW | PTE_R | PTE_X;
+          }
+        }
+        cow_refinc((uint64)pt);  // the parent's reference
+        *pmd |= PTE_COW;
+      }
+      if((cpte = walkpmd_alloc(new, a)) == 0)
+        goto err;
+      if(*cpte & PTE_V)
+        panic("uvmcopy: remap");
+      cow_refinc((uint64)pt);
+      *cpte = *pmd;
+      continue;
+    }
+
+    // the page that holds the trapframe is never shared, nor is
+    // one that maps hot pages; copy its PTEs one at a time.
+    cpt = 0;
+    for(; a < next; a += PGSIZE){
+      pte = &pt[PX(0, a)];
+      if((*pte & (PTE_V|PTE_GUARD)) == 0)
+        continue;  // not touched since sbrk; the child faults its own
+      if(cpt == 0){
+        if((cpte = walk(new, a, 1)) == 0)
+          goto err;
+        cpt = cpte - PX(0, a);
+      }
+      if((*pte & PTE_V) == 0){
+        cpt[PX(0, a)] = *pte;  // the stack guard page
+        continue;
+      }
+      if(budget > 0 && hotpage(*pte, a, sp) &&
+         eagercopy(pte, &cpt[PX(0, a)]) == 0){
+        budget--;
+        continue;
+      }
+      hotdone(*pte);
+      *pte &= ~(PTE_D|PTE_A|PTE_HOT);
+      cow_map(pte, &cpt[PX(0, a)]);
     }
   }
+  // the parent's writable pages just became read-only.
+  tlbflush_all(old);
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  tlbflush_all(old);
+  uvmunmap(new, 0, PGROUNDUP(sz) / PGSIZE, 1);
   return -1;
 }
 
-// mark a PTE invalid for user access.
+// Take a reference to the user page at va, for the kernel to
+// read later, as fork() would for a child: a writable page
+// becomes copy-on-write, so the process's later writes go to a
+// copy. A page not yet touched since sbrk() is the zero page.
+// Returns the page's physical address, or 0.
+uint64
+uvmgift(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+
+  if(lazy_fault(pagetable, va, 0) == -1)
+    return 0;
+  if((pte = walk(pagetable, va, 1)) == 0)
+    return 0;
+  if((*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U))
+    return 0;
+  if(*pte & PTE_W){
+    hotdone(*pte);
+    *pte = (*pte & ~(PTE_W|PTE_HOT)) | PTE_COW;
+    tlbflush_page(pagetable, va);
+  }
+  pa = PTE2PA(*pte);
+  cow_refinc(pa);
+  return pa;
+}
+
+// free the page at va and leave an invalid PTE that
+// lazy_fault() refuses to fill in, so that the kernel's
+// direct copies fault on it just as user accesses do.
 // used by exec for the user stack guard page.
 void
 uvmclear(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   
+  uvmunmap(pagetable, va, 1, 1);
   pte = walk(pagetable, va, 0);
   if(pte == 0)
     panic("uvmclear");
-  *pte &= ~PTE_U;
+  *pte = PTE_GUARD;
+}
+
+// Is pagetable the current process's, and so mapped in the
+// kernel page table this hart runs on? Then the copy routines
+// below access user memory directly, through copyuser() and
+// copyuserstr() (usercopy.S); kerneltrap() fills in lazy and
+// COW pages as they fault. Any other page table (exec()'s new
+// one) is walked in software.
+static int
+uvmlive(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  return p != 0 && p->pagetable == pagetable;
 }
 
 // Copy from kernel to user.
@@ -350,19 +972,28 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
 
+  if(uvmlive(pagetable)){
+    if(dstva > USERTOP || len > USERTOP - dstva)
+      return -1;
+    return copyuser((void*)dstva, src, len);
+  }
+
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
 
-    pte_t* pte = walk(pagetable, va0, 0);
-    if (pte == 0) return -1;
-    if ((*pte & PTE_V) == 0) return -1;
+    int level;
+    pte_t* pte = walkleaf(pagetable, va0, &level);
+    if (pte == 0 || (*pte & PTE_V) == 0) {
+      if (lazy_fault(pagetable, va0, 1) != 0) return -1;
+      pte = walkleaf(pagetable, va0, &level);
+    }
     if ((*pte & PTE_U) == 0) return -1;
     if ((*pte & PTE_COW) != 0) {
       if (cow_pgfault(pagetable, va0) != 0) return -1;
-      pte = walk(pagetable, va0, 0);
+      pte = walkleaf(pagetable, va0, &level);
       if (pte == 0) return -1;
     }
-    pa0 = PTE2PA(*pte);
+    pa0 = leafpa(*pte, level, va0);
 
     if(pa0 == 0)
       return -1;
@@ -386,6 +1017,12 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
 
+  if(uvmlive(pagetable)){
+    if(srcva > USERTOP || len > USERTOP - srcva)
+      return -1;
+    return copyuser(dst, (void*)srcva, len);
+  }
+
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
@@ -413,6 +1050,14 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   uint64 n, va0, pa0;
   int got_null = 0;
 
+  if(uvmlive(pagetable)){
+    if(srcva >= USERTOP)
+      return -1;
+    if(max > USERTOP - srcva)
+      max = USERTOP - srcva;
+    return copyuserstr(dst, (char*)srcva, max);
+  }
+
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
@@ -446,33 +1091,174 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   }
 }
 
+// Make the COW page at *pte private and writable, in place if
+// no one else maps the frame, else by copying it. extra is
+// or'd into the new PTE's flags.
+// Returns 0 if reused, 1 if copied, -1 if out of memory.
+static int
+cowbreak(pte_t *pte, uint64 extra)
+{
+  uint64 pa, mem, flags;
+  int ref;
+
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W | extra) & ~(PTE_COW|PTE_D|PTE_A);
+  ref = cow_refcount(pa);
+  if(ref == 0)
+    panic("cowbreak");
+  if(ref == 1){
+    // ours alone. no one else can gain a mapping of it
+    // meanwhile: only a fork by this process would.
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+  if(pa == (uint64)zeropage){
+    if((mem = (uint64)kalloc_zeroed()) == 0)
+      return -1;
+  } else {
+    if((mem = (uint64)kalloc()) == 0)
+      return -1;
+    memmove((char*)mem, (char*)pa, PGSIZE);
+  }
+  cow_refinc(mem);
+  *pte = PA2PTE(mem) | flags;
+  // hand back our reference to pa. if the other sharers let
+  // go of it while we copied, ours is the last and frees it.
+  if(cow_refdec(pa) == 0)
+    kfree((void*)pa);
+  return 1;
+}
+
+// Fault-around: having resolved a COW fault at va, also resolve
+// the COW pages within COWAROUND of it in the same (now private)
+// leaf page-table page pt, if that costs no copy or the hardware
+// saw them accessed since fork, which predicts a write.
+static void
+cowaround(pagetable_t pgtbl, pagetable_t pt, uint64 va)
+{
+  int i, lo, hi;
+  pte_t pte;
+
+  lo = PX(0, va) - COWAROUND;
+  hi = PX(0, va) + COWAROUND;
+  if(lo < 0)
+    lo = 0;
+  if(hi > 511)
+    hi = 511;
+  for(i = lo; i <= hi; i++){
+    pte = pt[i];
+    if(i == PX(0, va) || PTE2PA(pte) == (uint64)zeropage)
+      continue;
+    if((pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+      continue;
+    if((pte & PTE_A) == 0 && cow_refcount(PTE2PA(pte)) > 1)
+      continue;
+    if(cowbreak(&pt[i], PTE_HOT) < 0)
+      break;
+    __sync_fetch_and_add(&cowstat.around, 1);
+    tlbflush_page(pgtbl, MEGAPGROUNDDOWN(va) + (uint64)i*PGSIZE);
+  }
+}
+
+// Resolve a write to the copy-on-write page at va, in a single
+// walk of pgtbl, rewriting its PTE in place, then fault around it.
+// Returns 0 on success, -1 if out of memory, -2 if va is not
+// a COW page.
 int cow_pgfault(pagetable_t pgtbl, uint64 va){
   if (va >= MAXVA) return -2;
-  pte_t *pte = walk(pgtbl, va, 0);
-  if (!pte) {
+  va = PGROUNDDOWN(va);
+  uint64 next;
+  pte_t *pmd = walkpmd(pgtbl, va, va + PGSIZE, &next);
+  if (pmd == 0 || (*pmd & PTE_V) == 0)
     return -2;
+  if (PTE_LEAF(*pmd)) {
+    // a shared megapage: split it and copy just this page.
+    if ((*pmd & PTE_COW) == 0)
+      return -2;
+    if (splitmega(pmd) != 0)
+      return -1;
   }
-  if ((*pte & PTE_COW) == 0) {
+  pte_t *pte = &((pagetable_t)PTE2PA(*pmd))[PX(0, va)];
+  if ((*pte & PTE_V) == 0 || (*pte & PTE_COW) == 0)
     return -2;
+  if (*pmd & PTE_COW) {
+    // the leaf page-table page is shared too; once it is ours,
+    // the frame's refcount counts our PTE.
+    if (unsharept(pgtbl, pmd) != 0)
+      return -1;
+    pte = &((pagetable_t)PTE2PA(*pmd))[PX(0, va)];
   }
 
-  uint64 pa = PTE2PA(*pte);
-  if (*cow_refcount(pa) == 0)
-    panic("cow_pgfault");
-  if (*cow_refcount(pa) == 1) {
-    *pte |= PTE_W;
-    *pte &= ~PTE_COW;
+  struct proc *p = myproc();
+  int counted = p != 0 && p->pagetable == pgtbl;
+  int r = cowbreak(pte, 0);
+  if (r < 0)
+    return -1;
+  if (counted) {
+    p->ncowfault++;
+    if (r == 0)
+      p->ncowreuse++;
+    else
+      p->ncowcopy++;
+  }
+  tlbflush_page(pgtbl, va);
+  cowaround(pgtbl, (pagetable_t)PTE2PA(*pmd), va);
+  return 0;
+}
+
+// Print COW policy statistics. For debugging.
+void
+cowdump(void)
+{
+  printf("cow: eager %d around %d avoided %d unused %d\n",
+         (int)cowstat.eager, (int)cowstat.around,
+         (int)cowstat.avoided, (int)cowstat.unused);
+}
+
+// Fill in a page of heap that growproc() reserved but did not
+// allocate. Only the current process grows lazily, so va is
+// checked against its size. A read maps the shared zero page;
+// the first write then copies it through cow_pgfault().
+// A write into a 2MB-aligned region of heap that lies wholly
+// below p->sz and has nothing mapped yet gets a megapage.
+// Returns 0 on success, -1 if out of memory, -2 if va is not
+// an unmapped address below p->sz, or is the stack guard page.
+int lazy_fault(pagetable_t pgtbl, uint64 va, int write){
+  struct proc *p = myproc();
+  if (p == 0 || pgtbl != p->pagetable || va >= p->sz || va >= MAXVA)
+    return -2;
+  va = PGROUNDDOWN(va);
+  int level;
+  pte_t *pte = walkleaf(pgtbl, va, &level);
+  if (pte && (*pte & (PTE_V|PTE_GUARD)))
+    return -2;
+  uint64 mva = MEGAPGROUNDDOWN(va);
+  if (write && (pte == 0 || level == 1) && mva + MEGAPGSIZE <= p->sz) {
+    char *big = kalloc_pages(MEGAORDER);
+    if (big) {
+      memset(big, 0, MEGAPGSIZE);
+      if (mapmega(pgtbl, mva, (uint64)big, PTE_W|PTE_X|PTE_R|PTE_U) == 0) {
+        tlbflush_all(pgtbl);
+        return 0;
+      }
+      kfree_pages(big, MEGAORDER);
+    }
+    // no contiguous memory: fall back to a single page.
+  }
+  if (!write) {
+    if (mappages(pgtbl, va, PGSIZE, (uint64)zeropage,
+                 PTE_R|PTE_X|PTE_U|PTE_COW) != 0)
+      return -1;
+    tlbflush_page(pgtbl, va);
     return 0;
   }
-  uint64 mem = (uint64)kalloc();
-  if (mem == 0) {
+  char *mem = kalloc_zeroed();
+  if (mem == 0)
+    return -1;
+  if (mappages(pgtbl, va, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0) {
+    kfree(mem);
     return -1;
   }
-  memmove((char *)mem, (char *)pa, PGSIZE);
-  uint64 old_flags = PTE_FLAGS(*pte);
-  uint64 new_flags = (old_flags | PTE_W) & ~PTE_COW;
-  uvmunmap(pgtbl, PGROUNDDOWN(va), 1, 0);
-  if (mappages(pgtbl, PGROUNDDOWN(va), PGSIZE, mem, new_flags) != 0)
-    return -2;
+  tlbflush_page(pgtbl, va);
   return 0;
-}
\ No newline at end of file
+}
@@ -9,6 +9,12 @@ cat(int fd)
 {
   int n;
 
+  // when one end is a pipe, the kernel can move the data
+  // itself; otherwise splice() fails and we copy.
+  while((n = splice(fd, 1, 64*1024)) > 0)
+    ;
+  if(n == 0)
+    return;
   while((n = read(fd, buf, sizeof(buf))) > 0) {
     if (write(1, buf, n) != n) {
       fprintf(2, "cat: write error\n");
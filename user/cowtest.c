@@ -4,6 +4,7 @@
 
 #include "kernel/types.h"
 #include "kernel/memlayout.h"
+#include "kernel/fcntl.h"
 #include "user/user.h"
 
 // allocate more than half of physical memory,
@@ -177,6 +178,130 @@ filetest()
   printf("ok\n");
 }
 
+// write into 2MB-aligned heap, which the kernel may back with
+// megapages, then fork and have the child modify every other
+// page. the parent's copy must not change, and shrinking the
+// heap to a non-megapage boundary must still work.
+void
+megatest()
+{
+  enum { MEGA = 2*1024*1024 };
+  char *top, *p, *q;
+  int pid, xstatus;
+
+  printf("mega: ");
+
+  top = sbrk(0);
+  if(sbrk(MEGA - ((uint64)top % MEGA) + 2*MEGA) == (char*)0xffffffffffffffffL){
+    printf("sbrk failed\n");
+    exit(-1);
+  }
+  p = top + (MEGA - ((uint64)top % MEGA));
+  for(q = p; q < p + 2*MEGA; q += 4096)
+    *(int*)q = (q - p) / 4096;
+
+  pid = fork();
+  if(pid < 0){
+    printf("fork() failed\n");
+    exit(-1);
+  }
+  if(pid == 0){
+    for(q = p; q < p + 2*MEGA; q += 2*4096)
+      *(int*)q = -1;
+    for(q = p; q < p + 2*MEGA; q += 4096){
+      int want = ((q - p) / 4096) % 2 ? (q - p) / 4096 : -1;
+      if(*(int*)q != want){
+        printf("child saw wrong value\n");
+        exit(-1);
+      }
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(-1);
+  for(q = p; q < p + 2*MEGA; q += 4096){
+    if(*(int*)q != (q - p) / 4096){
+      printf("parent memory changed\n");
+      exit(-1);
+    }
+  }
+
+  // cut into the middle of the second 2MB.
+  sbrk(-(MEGA/2));
+  for(q = p; q < p + MEGA + MEGA/2; q += 4096){
+    if(*(int*)q != (q - p) / 4096){
+      printf("memory changed by shrink\n");
+      exit(-1);
+    }
+  }
+  sbrk(-(sbrk(0) - top));
+
+  printf("ok\n");
+}
+
+// vmsplice() pages into a pipe and then overwrite them; the
+// pipe must still deliver what they held when they were given.
+// then splice() a file into a pipe and read it back.
+void
+splicetest()
+{
+  enum { N = 3 };
+  char *top, *p, buf[64];
+  int fds[2], fd, i, j;
+
+  printf("splice: ");
+
+  top = sbrk(0);
+  if(sbrk(4096 - ((uint64)top % 4096) + N*4096) == (char*)0xffffffffffffffffL){
+    printf("sbrk failed\n");
+    exit(-1);
+  }
+  p = top + (4096 - ((uint64)top % 4096));
+  for(i = 0; i < N*4096; i++)
+    p[i] = i / 4096 + 'a';
+  if(pipe(fds) != 0){
+    printf("pipe() failed\n");
+    exit(-1);
+  }
+  if(vmsplice(fds[1], p, N*4096) != N*4096){
+    printf("vmsplice failed\n");
+    exit(-1);
+  }
+  for(i = 0; i < N*4096; i++)
+    p[i] = 'z';
+  for(i = 0; i < N*4096; i += j){
+    if((j = read(fds[0], buf, sizeof(buf))) <= 0){
+      printf("read failed\n");
+      exit(-1);
+    }
+    if(buf[0] != i / 4096 + 'a' || buf[j-1] != (i + j - 1) / 4096 + 'a'){
+      printf("pipe saw the overwrite\n");
+      exit(-1);
+    }
+  }
+
+  if((fd = open("splicetest", O_CREATE|O_RDWR)) < 0 ||
+     write(fd, "0123456789", 10) != 10){
+    printf("file setup failed\n");
+    exit(-1);
+  }
+  close(fd);
+  fd = open("splicetest", O_RDONLY);
+  if(splice(fd, fds[1], 100) != 10 || read(fds[0], buf, sizeof(buf)) != 10 ||
+     memcmp(buf, "0123456789", 10) != 0){
+    printf("splice from file failed\n");
+    exit(-1);
+  }
+  close(fd);
+  unlink("splicetest");
+  close(fds[0]);
+  close(fds[1]);
+  sbrk(-(sbrk(0) - top));
+
+  printf("ok\n");
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -191,6 +316,10 @@ main(int argc, char *argv[])
 
   filetest();
 
+  megatest();
+
+  splicetest();
+
   printf("ALL COW TESTS PASSED\n");
 
   exit(0);
@@ -0,0 +1,48 @@
+// Time fork() + exit() + wait() against the size of the parent.
+//
+// For each size the parent grows its heap, touches every page so
+// that it is really mapped, and then forks NFORK children that exit
+// at once. Each page is read before it is written, so that the heap
+// is mapped with 4096-byte pages rather than megapages. Times are
+// in timer ticks.
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define NFORK 100
+
+int sizes[] = { 0, 64, 256, 1024, 4096, 16384 }; // extra pages; 16384 is 64MB
+
+int
+main(int argc, char *argv[])
+{
+  int i, j, n, pid, t0, t1;
+  char *base, *p;
+
+  base = sbrk(0);
+  for(i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+    n = sizes[i];
+    if(sbrk(n*PGSIZE - (sbrk(0) - base)) == (char*)-1){
+      fprintf(2, "forkbench: sbrk %d pages failed\n", n);
+      exit(1);
+    }
+    for(p = base; p < base + n*PGSIZE; p += PGSIZE)
+      *p = *(volatile char*)p + 1;
+
+    t0 = uptime();
+    for(j = 0; j < NFORK; j++){
+      pid = fork();
+      if(pid < 0){
+        fprintf(2, "forkbench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0)
+        exit(0);
+      wait(0);
+    }
+    t1 = uptime();
+    printf("%d pages: %d forks in %d ticks\n", n, NFORK, t1 - t0);
+  }
+  exit(0);
+}
@@ -0,0 +1,131 @@
+// Time data through pipes.
+//
+// First a writer process pushes NBYTES through a pipe in
+// BUFSZ-byte writes to a reader. Then the equivalent of
+// "cat bigfile | wc", NRUN times over a FILESZ-byte file, with
+// the real cat and wc. Times are in timer ticks.
+
+#include "kernel/types.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define NBYTES  (8*1024*1024)
+#define BUFSZ   4096
+#define FILESZ  (64*1024)    // the file system is only FSSIZE blocks
+#define NRUN    20
+
+char buf[BUFSZ];
+
+void
+rawpipe(void)
+{
+  int fds[2], pid, n, total, t0, t1;
+
+  if(pipe(fds) < 0){
+    fprintf(2, "pipebench: pipe failed\n");
+    exit(1);
+  }
+  t0 = uptime();
+  pid = fork();
+  if(pid < 0){
+    fprintf(2, "pipebench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    for(total = 0; total < NBYTES; total += BUFSZ){
+      if(write(fds[1], buf, BUFSZ) != BUFSZ){
+        fprintf(2, "pipebench: write failed\n");
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+  close(fds[1]);
+  total = 0;
+  while((n = read(fds[0], buf, sizeof(buf))) > 0)
+    total += n;
+  close(fds[0]);
+  wait(0);
+  t1 = uptime();
+  if(total != NBYTES){
+    fprintf(2, "pipebench: read %d bytes, not %d\n", total, NBYTES);
+    exit(1);
+  }
+  printf("pipe: %d bytes in %d ticks\n", NBYTES, t1 - t0);
+}
+
+// run "cat file | wc", with wc's output to a scratch file.
+void
+catwc(char *file)
+{
+  int fds[2], out, pid1, pid2;
+  char *catargv[] = { "cat", file, 0 };
+  char *wcargv[] = { "wc", 0 };
+
+  if(pipe(fds) < 0 || (out = open("pipebench.out", O_CREATE|O_WRONLY|O_TRUNC)) < 0){
+    fprintf(2, "pipebench: pipe/open failed\n");
+    exit(1);
+  }
+  if((pid1 = fork()) == 0){
+    close(1);
+    dup(fds[1]);
+    close(fds[0]);
+    close(fds[1]);
+    exec("cat", catargv);
+    exit(1);
+  }
+  if((pid2 = fork()) == 0){
+    close(0);
+    dup(fds[0]);
+    close(1);
+    dup(out);
+    close(fds[0]);
+    close(fds[1]);
+    exec("wc", wcargv);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  close(out);
+  if(pid1 < 0 || pid2 < 0){
+    fprintf(2, "pipebench: fork failed\n");
+    exit(1);
+  }
+  wait(0);
+  wait(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd, i, n, t0, t1;
+
+  memset(buf, 'x', sizeof(buf));
+  for(i = 0; i < sizeof(buf); i += 64)
+    buf[i] = '\n';
+
+  rawpipe();
+
+  if((fd = open("pipebench.tmp", O_CREATE|O_WRONLY|O_TRUNC)) < 0){
+    fprintf(2, "pipebench: cannot create file\n");
+    exit(1);
+  }
+  for(n = 0; n < FILESZ; n += BUFSZ){
+    if(write(fd, buf, BUFSZ) != BUFSZ){
+      fprintf(2, "pipebench: file write failed\n");
+      exit(1);
+    }
+  }
+  close(fd);
+
+  t0 = uptime();
+  for(i = 0; i < NRUN; i++)
+    catwc("pipebench.tmp");
+  t1 = uptime();
+  printf("cat | wc: %d x %d bytes in %d ticks\n", NRUN, FILESZ, t1 - t0);
+
+  unlink("pipebench.tmp");
+  unlink("pipebench.out");
+  exit(0);
+}
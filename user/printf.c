@@ -6,12 +6,6 @@
 
 static char digits[] = "0123456789ABCDEF";
 
-static void
-putc(int fd, char c)
-{
-  write(fd, &c, 1);
-}
-
 static void
 printint(int fd, int xx, int base, int sgn)
 {
@@ -92,6 +86,8 @@ vprintf(int fd, const char *fmt, va_list ap)
       state = 0;
     }
   }
+  if(fd == 2)
+    fflush(fd);  // standard error is not kept waiting
 }
 
 void
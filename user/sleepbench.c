@@ -0,0 +1,70 @@
+// Time nanosleep() wakeups, and wakeups through a pipe.
+//
+// For each requested delay, sleeps NSLEEP times and prints the
+// average and worst time actually slept, as measured by
+// clock_gettime(). Then a child blocks reading a pipe, NSLEEP
+// times, and reports how long after the parent's write it ran;
+// the parent pauses first so that the child's cpu goes idle.
+// Times are in microseconds.
+
+#include "kernel/types.h"
+#include "user/user.h"
+
+#define NSLEEP 20
+
+int delays[] = { 10, 100, 1000, 10000 };  // microseconds
+
+int
+main(int argc, char *argv[])
+{
+  int i, j, fds[2];
+  uint64 t0, t1, d, sum, max;
+
+  for(i = 0; i < sizeof(delays)/sizeof(delays[0]); i++){
+    sum = max = 0;
+    for(j = 0; j < NSLEEP; j++){
+      clock_gettime(&t0);
+      if(nanosleep(delays[i] * 1000ULL) < 0){
+        fprintf(2, "sleepbench: nanosleep failed\n");
+        exit(1);
+      }
+      clock_gettime(&t1);
+      d = (t1 - t0) / 1000;
+      sum += d;
+      if(d > max)
+        max = d;
+    }
+    printf("nanosleep %d us: average %d us, worst %d us\n", delays[i],
+           (int)(sum / NSLEEP), (int)max);
+  }
+
+  if(pipe(fds) < 0){
+    fprintf(2, "sleepbench: pipe failed\n");
+    exit(1);
+  }
+  if(fork() == 0){
+    close(fds[1]);
+    sum = max = 0;
+    for(j = 0; j < NSLEEP; j++){
+      if(read(fds[0], &t0, sizeof(t0)) != sizeof(t0))
+        exit(1);
+      clock_gettime(&t1);
+      d = (t1 - t0) / 1000;
+      sum += d;
+      if(d > max)
+        max = d;
+    }
+    printf("pipe wakeup: average %d us, worst %d us\n",
+           (int)(sum / NSLEEP), (int)max);
+    exit(0);
+  }
+  close(fds[0]);
+  for(j = 0; j < NSLEEP; j++){
+    nanosleep(10000000);
+    clock_gettime(&t0);
+    write(fds[1], &t0, sizeof(t0));
+  }
+  close(fds[1]);
+  wait(0);
+  exit(0);
+}
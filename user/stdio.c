@@ -0,0 +1,139 @@
+// Buffered I/O on file descriptors.
+//
+// Each descriptor below NSTDIO gets an output buffer and an input
+// buffer the first time putc() or getc() uses it. Output is written
+// when the buffer fills, at each newline if the descriptor is a
+// device (the console), on fflush(), and before exit(), fork(),
+// exec() and spawn() (see ulib.c). Output on all console descriptors
+// is also written before getc() waits for input, so that prompts
+// show. Input is read a buffer at a time; a process that forks
+// after reading ahead leaves the read-ahead in both copies.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define NSTDIO  16    // descriptors with buffers (NOFILE)
+#define BUFSZ  512
+
+#define FULLBUF 1     // write when full
+#define LINEBUF 2     // also write at each newline
+
+struct stdbuf {
+  int mode;           // 0 until first use, then FULLBUF or LINEBUF
+  int nout;           // bytes waiting in out[]
+  int rpos;           // unread input is in[rpos..rend)
+  int rend;
+  char out[BUFSZ];
+  char in[BUFSZ];
+};
+
+static struct stdbuf bufs[NSTDIO];
+
+extern void (*stdiohook)(int);
+
+static void
+flush(int fd, struct stdbuf *b)
+{
+  if(b->nout > 0)
+    write(fd, b->out, b->nout);
+  b->nout = 0;
+}
+
+static void
+flushall(int mode)
+{
+  int fd;
+
+  for(fd = 0; fd < NSTDIO; fd++)
+    if(bufs[fd].mode >= mode)
+      flush(fd, &bufs[fd]);
+}
+
+// Called by exit() and friends with fd -1, and by close(fd).
+static void
+stdiosync(int fd)
+{
+  if(fd < 0){
+    flushall(FULLBUF);
+  } else if(fd < NSTDIO){
+    flush(fd, &bufs[fd]);
+    bufs[fd].mode = 0;
+    bufs[fd].rpos = bufs[fd].rend = 0;
+  }
+}
+
+static struct stdbuf*
+getbuf(int fd)
+{
+  struct stdbuf *b;
+  struct stat st;
+
+  if(fd < 0 || fd >= NSTDIO)
+    return 0;
+  b = &bufs[fd];
+  if(b->mode == 0){
+    b->mode = FULLBUF;
+    if(fstat(fd, &st) >= 0 && st.type == T_DEVICE)
+      b->mode = LINEBUF;
+    stdiohook = stdiosync;
+  }
+  return b;
+}
+
+void
+putc(int fd, char c)
+{
+  struct stdbuf *b;
+
+  if((b = getbuf(fd)) == 0){
+    write(fd, &c, 1);
+    return;
+  }
+  b->out[b->nout++] = c;
+  if(b->nout == BUFSZ || (c == '\n' && b->mode == LINEBUF))
+    flush(fd, b);
+}
+
+void
+fflush(int fd)
+{
+  if(fd >= 0 && fd < NSTDIO)
+    flush(fd, &bufs[fd]);
+}
+
+// Return the next byte from fd, or -1 at end of file or error.
+int
+getc(int fd)
+{
+  struct stdbuf *b;
+  uchar c;
+  int n;
+
+  if((b = getbuf(fd)) == 0)
+    return read(fd, &c, 1) == 1 ? c : -1;
+  if(b->rpos == b->rend){
+    flushall(LINEBUF);
+    if((n = read(fd, b->in, BUFSZ)) <= 0)
+      return -1;
+    b->rpos = 0;
+    b->rend = n;
+  }
+  return (uchar)b->in[b->rpos++];
+}
+
+char*
+gets(char *buf, int max)
+{
+  int i, c;
+
+  for(i=0; i+1 < max; ){
+    if((c = getc(0)) < 0)
+      break;
+    buf[i++] = c;
+    if(c == '\n' || c == '\r')
+      break;
+  }
+  buf[i] = '\0';
+  return buf;
+}
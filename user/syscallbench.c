@@ -0,0 +1,47 @@
+// Time system call round trips.
+//
+// The first loop makes bare getpid() calls. The second touches a
+// working set of pages between calls, so it also measures how
+// much of the TLB survives each trip through the kernel. Times
+// are in timer ticks; compare runs across kernels.
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define NCALL  200000
+#define NPAGE  32
+
+char ws[NPAGE*PGSIZE];
+
+int
+main(int argc, char *argv[])
+{
+  int i, j, t0, t1, sum;
+
+  if(argc > 1){
+    fprintf(2, "usage: syscallbench\n");
+    exit(1);
+  }
+
+  t0 = uptime();
+  for(i = 0; i < NCALL; i++)
+    getpid();
+  t1 = uptime();
+  printf("getpid: %d calls in %d ticks\n", NCALL, t1 - t0);
+
+  sum = 0;
+  for(j = 0; j < NPAGE; j++)
+    ws[j*PGSIZE] = j;
+  t0 = uptime();
+  for(i = 0; i < NCALL/10; i++){
+    getpid();
+    for(j = 0; j < NPAGE; j++)
+      sum += ws[j*PGSIZE];
+  }
+  t1 = uptime();
+  printf("getpid + %d pages: %d calls in %d ticks (%d)\n", NPAGE,
+         NCALL/10, t1 - t0, sum);
+
+  exit(0);
+}
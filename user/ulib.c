@@ -52,24 +52,6 @@ strchr(const char *s, char c)
   return 0;
 }
 
-char*
-gets(char *buf, int max)
-{
-  int i, cc;
-  char c;
-
-  for(i=0; i+1 < max; ){
-    cc = read(0, &c, 1);
-    if(cc < 1)
-      break;
-    buf[i++] = c;
-    if(c == '\n' || c == '\r')
-      break;
-  }
-  buf[i] = '\0';
-  return buf;
-}
-
 int
 stat(const char *n, struct stat *st)
 {
@@ -134,3 +116,57 @@ memcpy(void *dst, const void *src, uint n)
 {
   return memmove(dst, src, n);
 }
+
+// System calls that must first write out what stdio.c has
+// buffered. stdio.c sets stdiohook when it first buffers a
+// descriptor; programs linked without it (forktest) leave it 0.
+// stdiohook(-1) flushes every descriptor; stdiohook(fd) flushes
+// fd and forgets its buffers before fd is closed.
+
+int _fork(void);
+int _exit(int) __attribute__((noreturn));
+int _close(int);
+int _exec(char*, char**);
+int _spawn(char*, char**, int*);
+
+void (*stdiohook)(int);
+
+int
+fork(void)
+{
+  if(stdiohook)
+    stdiohook(-1);
+  return _fork();
+}
+
+int
+exit(int status)
+{
+  if(stdiohook)
+    stdiohook(-1);
+  _exit(status);
+}
+
+int
+close(int fd)
+{
+  if(stdiohook)
+    stdiohook(fd);
+  return _close(fd);
+}
+
+int
+exec(char *path, char **argv)
+{
+  if(stdiohook)
+    stdiohook(-1);
+  return _exec(path, argv);
+}
+
+int
+spawn(char *path, char **argv, int *fds)
+{
+  if(stdiohook)
+    stdiohook(-1);
+  return _spawn(path, argv, fds);
+}
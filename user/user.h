@@ -23,6 +23,11 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int spawn(char*, char**, int*);
+int splice(int, int, int);
+int vmsplice(int, void*, int);
+int nanosleep(uint64);
+int clock_gettime(uint64*);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -32,7 +37,6 @@ char* strchr(const char*, char c);
 int strcmp(const char*, const char*);
 void fprintf(int, const char*, ...);
 void printf(const char*, ...);
-char* gets(char*, int max);
 uint strlen(const char*);
 void* memset(void*, int, uint);
 void* malloc(uint);
@@ -40,3 +44,9 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+
+// stdio.c
+void putc(int, char);
+int getc(int);
+void fflush(int);
+char* gets(char*, int max);
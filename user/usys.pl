@@ -6,24 +6,27 @@ print "# generated by usys.pl - do not edit\n";
 
 print "#include \"kernel/syscall.h\"\n";
 
+# A stub named by a second argument is wrapped by a C function
+# of the syscall's own name in ulib.c.
 sub entry {
     my $name = shift;
-    print ".global $name\n";
-    print "${name}:\n";
+    my $sym = shift || $name;
+    print ".global $sym\n";
+    print "${sym}:\n";
     print " li a7, SYS_${name}\n";
     print " ecall\n";
     print " ret\n";
 }
 	
-entry("fork");
-entry("exit");
+entry("fork", "_fork");
+entry("exit", "_exit");
 entry("wait");
 entry("pipe");
 entry("read");
 entry("write");
-entry("close");
+entry("close", "_close");
 entry("kill");
-entry("exec");
+entry("exec", "_exec");
 entry("open");
 entry("mknod");
 entry("unlink");
@@ -36,3 +39,8 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("spawn", "_spawn");
+entry("splice");
+entry("vmsplice");
+entry("nanosleep");
+entry("clock_gettime");